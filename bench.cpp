@@ -0,0 +1,326 @@
+// Project UID db1f506d06d84ab787baf250c265e24e
+// uniqnames: mileslow and oboyleai
+#include "classifier.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+using namespace std;
+
+// Times tokenizing, counting, freezing and classifying on the bundled
+//  dataset pairs, and adding the test posts to a trained model against
+//  retraining on both files, and prints the results as JSON on stdout:
+//
+//  bench.exe [--reps N] [--threads N] [TRAIN_FILE TEST_FILE]...
+
+struct Dataset
+{
+    string train_file;
+    string test_file;
+    vector<pair<string, string>> train_rows;
+    vector<pair<string, string>> test_rows;
+    vector<string> test_posts;
+    size_t train_tokens = 0;
+    size_t test_tokens = 0;
+};
+
+// The wall time of each repetition of one phase, in seconds
+struct PhaseTimes
+{
+    string name;
+    size_t posts;
+    size_t tokens;
+    vector<double> seconds;
+};
+
+static vector<pair<string, string>> read_rows(const string &filename)
+{
+    csvstream csvin(filename);
+    vector<size_t> columns = csvin.column_indices({"tag", "content"});
+    vector<pair<string, string>> rows;
+    vector<string_view> row;
+    while (csvin.read_row(columns, row))
+        rows.push_back({string(row[0]), string(row[1])});
+    return rows;
+}
+
+static size_t count_tokens(const vector<pair<string, string>> &rows)
+{
+    Tokenizer tokenizer;
+    size_t tokens = 0;
+    for (const pair<string, string> &row : rows)
+        tokens += tokenizer.unique_words(row.second).size();
+    return tokens;
+}
+
+// Runs body reps times and records how long each run took
+template <typename Body>
+static void time_phase(PhaseTimes &phase, int reps, const Body &body)
+{
+    for (int rep = 0; rep < reps; rep++)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        body();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        phase.seconds.push_back(elapsed.count());
+    }
+}
+
+// Runs setup and then body reps times and records how long each body took
+template <typename Setup, typename Body>
+static void time_phase(PhaseTimes &phase, int reps, const Setup &setup,
+                       const Body &body)
+{
+    for (int rep = 0; rep < reps; rep++)
+    {
+        setup();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        body();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        phase.seconds.push_back(elapsed.count());
+    }
+}
+
+// Keeps results alive so the timed work cannot be optimized away
+static volatile size_t sink_checksum = 0;
+
+// Times adding the test posts to a model trained on the training posts,
+//  in place when a model has already seen every label, word and pair,
+//  against training a new model on both, and appends the phases.
+//  Classifying no posts brings the model up to date.
+static void bench_updates(const Dataset &data, int reps, int threads,
+                          vector<PhaseTimes> &phases)
+{
+    PhaseTimes retrain = {"retrain", data.train_rows.size() + data.test_rows.size(),
+                          data.train_tokens + data.test_tokens, {}};
+    PhaseTimes update_phase = {"update", data.test_rows.size(), data.test_tokens, {}};
+    PhaseTimes in_place = {"update_in_place", data.test_rows.size(),
+                           data.test_tokens, {}};
+    ostream no_output(nullptr);
+    vector<pair<string, string>> all_rows = data.train_rows;
+    all_rows.insert(all_rows.end(), data.test_rows.begin(), data.test_rows.end());
+    vector<string_view> no_posts;
+    vector<Prediction> results;
+    time_phase(retrain, reps, [&]()
+    {
+        Indentifier retrained(false, threads, no_output);
+        retrained.train(all_rows.begin(), all_rows.end());
+        retrained.classify_batch(no_posts, results);
+    });
+
+    unique_ptr<Indentifier> updated;
+    auto trained = [&]()
+    {
+        updated.reset(new Indentifier(false, threads, no_output));
+        updated->train(data.train_rows.begin(), data.train_rows.end());
+    };
+    auto update = [&]()
+    {
+        updated->update(data.test_rows.begin(), data.test_rows.end());
+        updated->classify_batch(no_posts, results);
+    };
+    time_phase(update_phase, reps, trained, update);
+    time_phase(in_place, reps, [&]() { trained(); update(); }, update);
+    phases.push_back(retrain);
+    phases.push_back(update_phase);
+    phases.push_back(in_place);
+}
+
+static vector<PhaseTimes> bench_dataset(const Dataset &data, int reps, int threads)
+{
+    vector<PhaseTimes> phases = {
+        {"tokenize", data.train_rows.size(), data.train_tokens, {}},
+        {"train", data.train_rows.size(), data.train_tokens, {}},
+        {"freeze", data.train_rows.size(), data.train_tokens, {}},
+        {"classify", data.test_posts.size(), data.test_tokens, {}},
+    };
+
+    time_phase(phases[0], reps, [&]()
+    {
+        Tokenizer tokenizer;
+        size_t tokens = 0;
+        for (const pair<string, string> &row : data.train_rows)
+            tokens += tokenizer.unique_words(row.second).size();
+        sink_checksum += tokens;
+    });
+
+    CountTable counts;
+    time_phase(phases[1], reps, [&]()
+    {
+        Tokenizer tokenizer;
+        counts = CountTable();
+        for (const pair<string, string> &row : data.train_rows)
+            counts.add_post(row.first, tokenizer.unique_words(row.second));
+        sink_checksum += counts.label_word_freq_map.size();
+    });
+
+    time_phase(phases[2], reps, [&]()
+    {
+        FrozenModel model;
+        model.build(counts);
+        sink_checksum += model.num_words();
+    });
+
+    ostream no_output(nullptr);
+    Indentifier ident(false, threads, no_output);
+    ident.train(data.train_rows.begin(), data.train_rows.end());
+    vector<string_view> posts(data.test_posts.begin(), data.test_posts.end());
+    vector<Prediction> results;
+    time_phase(phases[3], reps, [&]()
+    {
+        ident.classify_batch(posts, results);
+        for (const Prediction &result : results)
+            sink_checksum += result.label;
+    });
+    bench_updates(data, reps, threads, phases);
+    return phases;
+}
+
+// str as a JSON string, quoted and escaped
+static string json_string(const string &str)
+{
+    string quoted = "\"";
+    for (unsigned char c : str)
+    {
+        char escaped[8];
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (c < 0x20)
+        {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+        {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+// count / seconds as a JSON number, or null for a phase too fast to time,
+//  where dividing would give inf, which is not JSON
+static string json_rate(double count, double seconds)
+{
+    if (!(seconds > 0))
+        return "null";
+    ostringstream rate;
+    rate.precision(cout.precision());
+    rate << count / seconds;
+    return rate.str();
+}
+
+static void print_phase_json(const PhaseTimes &phase)
+{
+    double mean = 0;
+    double min_seconds = phase.seconds[0];
+    for (double seconds : phase.seconds)
+    {
+        mean += seconds;
+        min_seconds = min(min_seconds, seconds);
+    }
+    mean /= phase.seconds.size();
+    double variance = 0;
+    for (double seconds : phase.seconds)
+        variance += (seconds - mean) * (seconds - mean);
+    variance /= phase.seconds.size();
+
+    cout << "        " << json_string(phase.name) << ": {"
+         << "\"mean_s\": " << mean
+         << ", \"stddev_s\": " << sqrt(variance)
+         << ", \"min_s\": " << min_seconds
+         << ", \"posts_per_s\": " << json_rate(phase.posts, mean)
+         << ", \"tokens_per_s\": " << json_rate(phase.tokens, mean)
+         << ", \"ns_per_post\": " << (phase.posts ? mean * 1e9 / phase.posts : 0)
+         << "}";
+}
+
+int main(int argc, char *argv[])
+{
+    int reps = 5;
+    int threads = 1;
+    vector<string> files;
+    bool args_ok = true;
+    for (int i = 1; i < argc && args_ok; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--reps") == 0 && has_value && atoi(argv[i + 1]) > 0)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && has_value &&
+                 atoi(argv[i + 1]) > 0)
+            threads = atoi(argv[++i]);
+        else if (strncmp(argv[i], "--", 2) == 0)
+            args_ok = false;
+        else
+            files.push_back(argv[i]);
+    }
+    if (files.empty())
+    {
+        files = {"train_small.csv", "test_small.csv",
+                 "w16_projects_exam.csv", "sp16_projects_exam.csv",
+                 "w14-f15_instructor_student.csv", "w16_instructor_student.csv"};
+    }
+    if (!args_ok || files.size() % 2 != 0)
+    {
+        cout << "Usage: bench.exe [--reps N] [--threads N] "
+                "[TRAIN_FILE TEST_FILE]..."
+             << endl;
+        return 1;
+    }
+
+    cout.precision(6);
+    cout << "{\n"
+         << "  \"reps\": " << reps << ",\n"
+         << "  \"threads\": " << threads << ",\n"
+         << "  \"datasets\": [\n";
+    for (size_t i = 0; i < files.size(); i += 2)
+    {
+        Dataset data;
+        data.train_file = files[i];
+        data.test_file = files[i + 1];
+        try
+        {
+            data.train_rows = read_rows(data.train_file);
+            data.test_rows = read_rows(data.test_file);
+            for (const pair<string, string> &row : data.test_rows)
+                data.test_posts.push_back(row.second);
+            data.train_tokens = count_tokens(data.train_rows);
+            data.test_tokens = count_tokens(data.test_rows);
+        }
+        catch (const csvstream_exception &e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+
+        vector<PhaseTimes> phases = bench_dataset(data, reps, threads);
+        cout << "    {\n"
+             << "      \"train\": " << json_string(data.train_file) << ",\n"
+             << "      \"test\": " << json_string(data.test_file) << ",\n"
+             << "      \"train_posts\": " << data.train_rows.size() << ",\n"
+             << "      \"train_tokens\": " << data.train_tokens << ",\n"
+             << "      \"test_posts\": " << data.test_posts.size() << ",\n"
+             << "      \"test_tokens\": " << data.test_tokens << ",\n"
+             << "      \"phases\": {\n";
+        for (size_t p = 0; p < phases.size(); p++)
+        {
+            print_phase_json(phases[p]);
+            cout << (p + 1 < phases.size() ? ",\n" : "\n");
+        }
+        cout << "      }\n"
+             << "    }" << (i + 2 < files.size() ? ",\n" : "\n");
+    }
+    cout << "  ]\n"
+         << "}" << endl;
+}
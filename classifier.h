@@ -0,0 +1,3047 @@
+// Project UID db1f506d06d84ab787baf250c265e24e
+// uniqnames: mileslow and oboyleai
+
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+/* classifier.h
+ *
+ * Naive Bayes classifier for labeled posts: training, model files and
+ * scoring. main.cpp is the command line tool built on top of it.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <cassert>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <exception>
+#include "csvstream.h"
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <cfloat>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <thread>
+#include <chrono>
+#include <charconv>
+#include <type_traits>
+#include <ctime>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// FNV-1a hash of the len bytes at str
+inline uint64_t hash_string(const char *str, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Hash of the len bytes at data, 8 bytes at a time, for telling whether a
+//  file changed. Much faster than hash_string() on large inputs.
+inline uint64_t hash_bytes(const char *data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns the smallest power of two that is at least twice n
+inline uint32_t hash_slot_count(uint32_t n)
+{
+    uint32_t slots = 1;
+    while (slots < 2 * uint64_t(n))
+        slots *= 2;
+    return slots;
+}
+
+// Assigns each distinct string a dense ID, in the order it was first seen.
+//  Lookups go through an open-addressing hash table over the names, so
+//  finding or adding a string is expected O(1) and takes a string_view.
+class Interner
+{
+private:
+    std::vector<std::string> names;
+
+    // The hash of each name, indexed by ID
+    std::vector<uint32_t> hashes;
+
+    // Open-addressing table of ID + 1 values, 0 for an empty slot. Always
+    //  at least twice as large as the number of names.
+    std::vector<uint32_t> slots;
+
+    // Returns the slot holding str, or the empty slot where it belongs
+    uint32_t slot_for(std::string_view str, uint32_t hash) const
+    {
+        uint32_t mask = slots.size() - 1;
+        uint32_t slot = hash & mask;
+        while (slots[slot] != 0)
+        {
+            uint32_t id = slots[slot] - 1;
+            if (hashes[id] == hash && names[id] == str)
+                break;
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void rehash(uint32_t num_slots)
+    {
+        slots.assign(num_slots, 0);
+        uint32_t mask = num_slots - 1;
+        for (uint32_t id = 0; id < names.size(); id++)
+        {
+            uint32_t slot = hashes[id] & mask;
+            while (slots[slot] != 0)
+                slot = (slot + 1) & mask;
+            slots[slot] = id + 1;
+        }
+    }
+
+public:
+    static const uint32_t NOT_FOUND = UINT32_MAX;
+
+    Interner()
+    {
+        slots.assign(16, 0);
+    }
+
+    // Returns the ID of str, assigning the next free ID if str is new.
+    //  Sets added to whether it was new.
+    uint32_t intern(std::string_view str, bool &added)
+    {
+        uint32_t hash = hash_string(str.data(), str.size());
+        uint32_t slot = slot_for(str, hash);
+        added = slots[slot] == 0;
+        if (!added)
+            return slots[slot] - 1;
+
+        uint32_t id = names.size();
+        names.push_back(std::string(str));
+        hashes.push_back(hash);
+        slots[slot] = id + 1;
+        if (2 * uint64_t(names.size()) > slots.size())
+            rehash(2 * slots.size());
+        return id;
+    }
+
+    uint32_t intern(std::string_view str)
+    {
+        bool added;
+        return intern(str, added);
+    }
+
+    // Returns the ID of str, or NOT_FOUND if it was never interned
+    uint32_t find(std::string_view str) const
+    {
+        uint32_t slot = slot_for(str, hash_string(str.data(), str.size()));
+        return slots[slot] == 0 ? NOT_FOUND : slots[slot] - 1;
+    }
+    const std::string &name(uint32_t id) const
+    {
+        return names[id];
+    }
+
+    uint32_t size() const
+    {
+        return names.size();
+    }
+
+    // The total length of every name
+    uint64_t names_size() const
+    {
+        uint64_t total = 0;
+        for (const std::string &name : names)
+            total += name.size();
+        return total;
+    }
+
+    // Copies every name into pool from offset pool_used on, in ID order.
+    //  Sets name_begin[id] to the offset of each name, and name_begin[size()]
+    //  to the offset after the last one, which it returns.
+    uint64_t pack_names(char *pool, uint64_t pool_used, uint64_t *name_begin) const
+    {
+        for (uint32_t id = 0; id < names.size(); id++)
+        {
+            name_begin[id] = pool_used;
+            memcpy(pool + pool_used, names[id].data(), names[id].size());
+            pool_used += names[id].size();
+        }
+        name_begin[names.size()] = pool_used;
+        return pool_used;
+    }
+
+    // Fills in an open-addressing table of ID + 1 values with num_slots
+    //  slots, a power of two, laid out the same as this one's
+    void fill_slots(uint32_t *table, uint32_t num_slots) const
+    {
+        uint32_t mask = num_slots - 1;
+        for (uint32_t id = 0; id < names.size(); id++)
+        {
+            uint32_t slot = hashes[id] & mask;
+            while (table[slot] != 0)
+                slot = (slot + 1) & mask;
+            table[slot] = id + 1;
+        }
+    }
+
+    // Returns every ID, ordered by the string it stands for
+    std::vector<uint32_t> sorted_ids() const
+    {
+        std::vector<uint32_t> order(names.size());
+        for (uint32_t id = 0; id < order.size(); id++)
+            order[id] = id;
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+             { return names[a] < names[b]; });
+        return order;
+    }
+};
+
+// Calls body(i) for every i in [0, count) using up to threads threads.
+//  Threads claim blocks of consecutive indexes until none are left, so
+//  body must only write to state owned by its own index.
+template <typename Body>
+inline void parallel_for(size_t count, int threads, const Body &body,
+                         size_t block = 64)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+        size_t begin;
+        while ((begin = next.fetch_add(block)) < count)
+        {
+            size_t end = std::min(count, begin + block);
+            for (size_t i = begin; i < end; i++)
+                body(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads && t * block < count; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (std::thread &t : pool)
+        t.join();
+}
+
+// Packs a (label, word) ID pair into one key
+inline uint64_t label_word_key(uint32_t label, uint32_t word)
+{
+    return (uint64_t(label) << 32) | word;
+}
+
+// Splits post content into its unique words, in sorted order, the same
+//  words istringstream >> string would extract. The words are views into
+//  the content, and the buffers are reused across calls, so tokenizing
+//  does no heap allocation once they have grown to fit the largest post.
+class Tokenizer
+{
+private:
+    // Every word in the content, then only the unique ones
+    std::vector<std::string_view> tokens;
+    std::vector<std::string_view> words;
+
+    // Open-addressing set of indexes into words. A slot is in use only if
+    //  its stamp matches the current call, so it never needs clearing.
+    std::vector<uint32_t> slot_stamps;
+    std::vector<uint32_t> slot_words;
+    uint32_t stamp = 0;
+
+    static bool is_space(char c)
+    {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+public:
+    // Returns the unique words of content in sorted order. The result is
+    //  valid until the next call or until content changes.
+    const std::vector<std::string_view> &unique_words(std::string_view content)
+    {
+        tokens.clear();
+        size_t i = 0;
+        while (i < content.size())
+        {
+            while (i < content.size() && is_space(content[i]))
+                i++;
+            size_t begin = i;
+            while (i < content.size() && !is_space(content[i]))
+                i++;
+            if (i > begin)
+                tokens.push_back(content.substr(begin, i - begin));
+        }
+
+        uint32_t num_slots = hash_slot_count(tokens.size());
+        if (slot_stamps.size() < num_slots || ++stamp == 0)
+        {
+            slot_stamps.assign(std::max<size_t>(num_slots, slot_stamps.size()), 0);
+            slot_words.resize(slot_stamps.size());
+            stamp = 1;
+        }
+        uint32_t mask = num_slots - 1;
+
+        words.clear();
+        for (std::string_view token : tokens)
+        {
+            uint32_t slot = hash_string(token.data(), token.size()) & mask;
+            while (slot_stamps[slot] == stamp && words[slot_words[slot]] != token)
+                slot = (slot + 1) & mask;
+            if (slot_stamps[slot] != stamp)
+            {
+                slot_stamps[slot] = stamp;
+                slot_words[slot] = words.size();
+                words.push_back(token);
+            }
+        }
+        std::sort(words.begin(), words.end());
+        return words;
+    }
+};
+
+// Training counts keyed by dense IDs. Tables counted over consecutive
+//  shards of the training rows can be merged, in shard order, into exactly
+//  the table a single pass over all rows would build.
+struct CountTable
+{
+    // The total number of posts in the entire training set.
+    int post_count = 0;
+
+    // The number of unique words in the entire training set.
+    //  (The vocabulary size.)
+    int unique_word_count = 0;
+
+    // Dense IDs for every word and label seen in training
+    Interner vocab;
+    Interner labels;
+
+    // For each word w, the number of posts in the entire
+    //  training set that contain w. Indexed by word ID.
+    std::vector<int> post_count_per_word;
+
+    // For each label C, the number of posts with that label.
+    //  Indexed by label ID.
+    std::vector<int> post_count_per_label;
+
+    // For each label C and word  w, the number of posts
+    //  with label C that contain w. Keyed by label_word_key().
+    std::unordered_map<uint64_t, int> label_word_freq_map;
+
+    // Counts one post with label tag and the given unique words
+    void add_post(std::string_view tag,
+                  const std::vector<std::string_view> &content_words)
+    {
+        // adds to post_count_per_label
+        uint32_t tag_id = labels.intern(tag);
+        if (tag_id == post_count_per_label.size())
+            post_count_per_label.push_back(1);
+        else
+            post_count_per_label[tag_id]++;
+
+        // content_words has no duplicates, so each word counts once
+        for (std::string_view word : content_words)
+        {
+            // increments spot in array for word, adding it to the
+            // vocabulary the first time it is seen
+            bool first_seen;
+            uint32_t word_id = vocab.intern(word, first_seen);
+            if (first_seen)
+            {
+                post_count_per_word.push_back(1);
+                unique_word_count++;
+            }
+            else
+            {
+                post_count_per_word[word_id]++;
+            }
+
+            // increments spot in map for pair
+            label_word_freq_map[label_word_key(tag_id, word_id)]++;
+        }
+
+        post_count++;
+    }
+
+    // Adds the counts of other, which must cover the training rows that
+    //  come right after the ones counted here. Labels and words new to
+    //  this table get IDs in the order other first saw them, which is the
+    //  order a single pass would have seen them.
+    void merge(const CountTable &other)
+    {
+        std::vector<uint32_t> label_ids(other.labels.size());
+        for (uint32_t tag = 0; tag < other.labels.size(); tag++)
+        {
+            label_ids[tag] = labels.intern(other.labels.name(tag));
+            if (label_ids[tag] == post_count_per_label.size())
+                post_count_per_label.push_back(0);
+            post_count_per_label[label_ids[tag]] +=
+                other.post_count_per_label[tag];
+        }
+
+        std::vector<uint32_t> word_ids(other.vocab.size());
+        for (uint32_t word = 0; word < other.vocab.size(); word++)
+        {
+            bool first_seen;
+            word_ids[word] = vocab.intern(other.vocab.name(word), first_seen);
+            if (first_seen)
+            {
+                post_count_per_word.push_back(0);
+                unique_word_count++;
+            }
+            post_count_per_word[word_ids[word]] +=
+                other.post_count_per_word[word];
+        }
+
+        std::unordered_map<uint64_t, int>::const_iterator it;
+        for (it = other.label_word_freq_map.begin();
+             it != other.label_word_freq_map.end(); it++)
+        {
+            uint32_t tag = label_ids[it->first >> 32];
+            uint32_t word = word_ids[uint32_t(it->first)];
+            label_word_freq_map[label_word_key(tag, word)] += it->second;
+        }
+
+        post_count += other.post_count;
+    }
+};
+
+// A custom exception type for model files that cannot be read or written
+class model_exception : public std::exception
+{
+public:
+    const char *what() const noexcept override
+    {
+        return msg.c_str();
+    }
+    const std::string msg;
+    model_exception(const std::string &msg) : msg(msg) {}
+};
+
+// Model files are a ModelHeader followed by the sections below, each
+//  starting at an 8-byte aligned offset from the start of the file. All
+//  integers and doubles are little-endian, so a mapped model file can be
+//  used in place without any parsing.
+const char MODEL_MAGIC[8] = {'N', 'B', 'M', 'O', 'D', 'E', 'L', '\0'};
+const uint32_t MODEL_VERSION = 1;
+const uint32_t MODEL_BYTE_ORDER = 0x01020304;
+
+enum ModelSection
+{
+    LABEL_NAME_BEGIN,     // uint64_t[L + 1], offsets into STRING_POOL
+    WORD_NAME_BEGIN,      // uint64_t[V + 1], offsets into STRING_POOL
+    STRING_POOL,          // char[], every label name then every word
+    LABEL_POST_COUNT,     // int32_t[L], posts with each label
+    WORD_POST_COUNT,      // int32_t[V], posts containing each word
+    LABEL_ORDER,          // uint32_t[L], label IDs ordered by name
+    WORD_ORDER,           // uint32_t[V], word IDs ordered by name
+    LOG_PRIOR,            // double[L]
+    LOG_SEEN_ELSEWHERE,   // double[V]
+    WORD_BEGIN,           // uint32_t[V + 1], offsets into the ENTRY_ sections
+    ENTRY_LABEL,          // uint32_t[E], sorted within each word
+    ENTRY_COUNT,          // int32_t[E], posts with the label and word
+    ENTRY_LOG_LIKELIHOOD, // double[E]
+    LABEL_SLOTS,          // uint32_t[label_slots], label ID + 1, 0 if empty
+    WORD_SLOTS,           // uint32_t[word_slots], word ID + 1, 0 if empty
+    NUM_SECTIONS
+};
+
+struct ModelHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    uint64_t post_count;
+    uint64_t num_entries;
+    uint32_t num_labels;
+    uint32_t num_words;
+    uint32_t label_slots;
+    uint32_t word_slots;
+    // log(1 / post_count), for words that never occur in training
+    double log_never_seen;
+    uint64_t section_begin[NUM_SECTIONS];
+    uint64_t section_size[NUM_SECTIONS];
+};
+
+// Immutable log-probability tables built from the training counts, plus
+//  the counts and names needed to print or extend them. The tables are one
+//  flat image in the model file layout, either built in memory from a
+//  CountTable or mapped straight from a saved model file.
+class FrozenModel
+{
+private:
+    // The image when built in memory. Empty when mapped from a file.
+    std::vector<uint64_t> image;
+
+    // The mapped model file, if any
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    const ModelHeader *header = nullptr;
+    const uint64_t *label_name_begin = nullptr;
+    const uint64_t *word_name_begin = nullptr;
+    const char *string_pool = nullptr;
+    const int32_t *label_post_counts = nullptr;
+    const int32_t *word_post_counts = nullptr;
+    const uint32_t *label_order = nullptr;
+    const uint32_t *word_order = nullptr;
+    const double *log_priors = nullptr;
+    const double *log_seen_elsewhere = nullptr;
+    const uint32_t *word_begin = nullptr;
+    const uint32_t *entry_labels = nullptr;
+    const int32_t *entry_counts = nullptr;
+    const double *entry_log_likelihoods = nullptr;
+    const uint32_t *label_slots = nullptr;
+    const uint32_t *word_slots = nullptr;
+
+    // The (entry, word ID) pairs of each label, grouped by label ID like
+    //  the entries are grouped by word. Built by refresh() when needed.
+    std::vector<uint32_t> label_entry_begin;
+    std::vector<std::pair<uint32_t, uint32_t>> label_entries;
+
+    template <typename T>
+    const T *section(const char *base, ModelSection which) const
+    {
+        return reinterpret_cast<const T *>(base + header->section_begin[which]);
+    }
+
+    // Fills in the header's section sizes and offsets from its counts
+    static void lay_out(ModelHeader &head, uint64_t string_pool_size)
+    {
+        uint64_t L = head.num_labels;
+        uint64_t V = head.num_words;
+        uint64_t E = head.num_entries;
+        uint64_t *size = head.section_size;
+        size[LABEL_NAME_BEGIN] = (L + 1) * sizeof(uint64_t);
+        size[WORD_NAME_BEGIN] = (V + 1) * sizeof(uint64_t);
+        size[STRING_POOL] = string_pool_size;
+        size[LABEL_POST_COUNT] = L * sizeof(int32_t);
+        size[WORD_POST_COUNT] = V * sizeof(int32_t);
+        size[LABEL_ORDER] = L * sizeof(uint32_t);
+        size[WORD_ORDER] = V * sizeof(uint32_t);
+        size[LOG_PRIOR] = L * sizeof(double);
+        size[LOG_SEEN_ELSEWHERE] = V * sizeof(double);
+        size[WORD_BEGIN] = (V + 1) * sizeof(uint32_t);
+        size[ENTRY_LABEL] = E * sizeof(uint32_t);
+        size[ENTRY_COUNT] = E * sizeof(int32_t);
+        size[ENTRY_LOG_LIKELIHOOD] = E * sizeof(double);
+        size[LABEL_SLOTS] = head.label_slots * sizeof(uint32_t);
+        size[WORD_SLOTS] = head.word_slots * sizeof(uint32_t);
+
+        uint64_t offset = sizeof(ModelHeader);
+        for (int i = 0; i < NUM_SECTIONS; i++)
+        {
+            offset = (offset + 7) / 8 * 8;
+            head.section_begin[i] = offset;
+            offset += size[i];
+        }
+        head.file_size = (offset + 7) / 8 * 8;
+    }
+
+    // Whether the n + 1 offsets at begin never decrease
+    template <typename T>
+    static bool ascending(const T *begin, uint64_t n)
+    {
+        for (uint64_t i = 0; i < n; i++)
+        {
+            if (begin[i] > begin[i + 1])
+                return false;
+        }
+        return true;
+    }
+
+    // Whether the n IDs at ids are each of 0 to n - 1 once
+    static bool permutation(const uint32_t *ids, uint32_t n)
+    {
+        std::vector<bool> seen(n);
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (ids[i] >= n || seen[ids[i]])
+                return false;
+            seen[ids[i]] = true;
+        }
+        return true;
+    }
+
+    // Whether a table of ID + 1 values for n IDs has a power of two
+    //  slots, holds no ID of n or more, and has an empty slot to end every
+    //  probe
+    static bool valid_slots(const uint32_t *slots, uint32_t num_slots, uint32_t n)
+    {
+        if (num_slots == 0 || (num_slots & (num_slots - 1)) != 0)
+            return false;
+        bool has_empty = false;
+        for (uint32_t slot = 0; slot < num_slots; slot++)
+        {
+            if (slots[slot] > n)
+                return false;
+            has_empty = has_empty || slots[slot] == 0;
+        }
+        return has_empty;
+    }
+
+    // Whether every table in an attached image is consistent, so that no
+    //  ID or offset read from it indexes out of range. Every name must be
+    //  found through its slot table, which also means no name repeats.
+    bool consistent() const
+    {
+        uint32_t L = header->num_labels;
+        uint32_t V = header->num_words;
+        if (label_name_begin[0] != 0 || !ascending(label_name_begin, L) ||
+            label_name_begin[L] != word_name_begin[0] ||
+            !ascending(word_name_begin, V) ||
+            word_name_begin[V] != header->section_size[STRING_POOL] ||
+            word_begin[0] != 0 || !ascending(word_begin, V) ||
+            word_begin[V] != header->num_entries ||
+            !permutation(label_order, L) || !permutation(word_order, V) ||
+            !valid_slots(label_slots, header->label_slots, L) ||
+            !valid_slots(word_slots, header->word_slots, V))
+            return false;
+
+        // each word's entries are sorted by label, without repeats
+        for (uint32_t word = 0; word < V; word++)
+        {
+            for (uint32_t entry = word_begin[word]; entry < word_begin[word + 1]; entry++)
+            {
+                if (entry_labels[entry] >= L ||
+                    (entry > word_begin[word] &&
+                     entry_labels[entry - 1] >= entry_labels[entry]))
+                    return false;
+            }
+        }
+        auto view = [this](const uint64_t *name_begin, uint32_t id)
+        {
+            return std::string_view(string_pool + name_begin[id],
+                                    name_begin[id + 1] - name_begin[id]);
+        };
+        for (uint32_t tag = 0; tag < L; tag++)
+        {
+            if (find_label(view(label_name_begin, tag)) != tag)
+                return false;
+        }
+        for (uint32_t word = 0; word < V; word++)
+        {
+            if (find_word(view(word_name_begin, word)) != word)
+                return false;
+        }
+        return true;
+    }
+
+    // Checks that data holds a complete, consistent model image and points
+    //  every table into it. Throws model_exception if it does not.
+    void attach(const char *data, size_t size, const std::string &filename)
+    {
+        const ModelHeader *head = reinterpret_cast<const ModelHeader *>(data);
+        if (size < sizeof(ModelHeader) ||
+            memcmp(head->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+            throw model_exception("Not a model file: " + filename);
+        if (head->version != MODEL_VERSION)
+            throw model_exception("Unsupported model version " +
+                                  std::to_string(head->version) + ": " + filename);
+        if (head->byte_order != MODEL_BYTE_ORDER)
+            throw model_exception("Model byte order does not match this "
+                                  "machine: " + filename);
+
+        ModelHeader expected = *head;
+        lay_out(expected, head->section_size[STRING_POOL]);
+        if (head->file_size != size || head->num_entries > UINT32_MAX ||
+            head->section_size[STRING_POOL] > size ||
+            memcmp(&expected, head, sizeof(ModelHeader)) != 0)
+            throw model_exception("Corrupt model file: " + filename);
+
+        header = head;
+        label_name_begin = section<uint64_t>(data, LABEL_NAME_BEGIN);
+        word_name_begin = section<uint64_t>(data, WORD_NAME_BEGIN);
+        string_pool = section<char>(data, STRING_POOL);
+        label_post_counts = section<int32_t>(data, LABEL_POST_COUNT);
+        word_post_counts = section<int32_t>(data, WORD_POST_COUNT);
+        label_order = section<uint32_t>(data, LABEL_ORDER);
+        word_order = section<uint32_t>(data, WORD_ORDER);
+        log_priors = section<double>(data, LOG_PRIOR);
+        log_seen_elsewhere = section<double>(data, LOG_SEEN_ELSEWHERE);
+        word_begin = section<uint32_t>(data, WORD_BEGIN);
+        entry_labels = section<uint32_t>(data, ENTRY_LABEL);
+        entry_counts = section<int32_t>(data, ENTRY_COUNT);
+        entry_log_likelihoods = section<double>(data, ENTRY_LOG_LIKELIHOOD);
+        label_slots = section<uint32_t>(data, LABEL_SLOTS);
+        word_slots = section<uint32_t>(data, WORD_SLOTS);
+
+        // images built in memory are consistent by construction
+        if (mapping && !consistent())
+        {
+            header = nullptr;
+            throw model_exception("Corrupt model file: " + filename);
+        }
+    }
+
+    void release()
+    {
+        if (mapping)
+            munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+        image.clear();
+        header = nullptr;
+        label_entry_begin.clear();
+        label_entries.clear();
+    }
+
+    // Groups the entries by label for refresh()
+    void index_entries_by_label()
+    {
+        label_entry_begin.assign(header->num_labels + 1, 0);
+        for (uint32_t entry = 0; entry < header->num_entries; entry++)
+            label_entry_begin[entry_labels[entry] + 1]++;
+        for (uint32_t tag = 0; tag < header->num_labels; tag++)
+            label_entry_begin[tag + 1] += label_entry_begin[tag];
+
+        std::vector<uint32_t> next(label_entry_begin.begin(),
+                                   label_entry_begin.end() - 1);
+        label_entries.resize(header->num_entries);
+        for (uint32_t word = 0; word < header->num_words; word++)
+        {
+            for (uint32_t entry = word_begin[word]; entry < word_begin[word + 1]; entry++)
+                label_entries[next[entry_labels[entry]]++] = {entry, word};
+        }
+    }
+
+    // Returns the ID whose name is str in an open-addressing table of
+    //  ID + 1 values, or NOT_FOUND
+    uint32_t find(const uint32_t *slots, uint32_t num_slots,
+                  const uint64_t *name_begin, std::string_view str) const
+    {
+        uint32_t mask = num_slots - 1;
+        uint32_t slot = hash_string(str.data(), str.size()) & mask;
+        for (; slots[slot] != 0; slot = (slot + 1) & mask)
+        {
+            uint32_t id = slots[slot] - 1;
+            uint64_t len = name_begin[id + 1] - name_begin[id];
+            if (len == str.size() &&
+                memcmp(string_pool + name_begin[id], str.data(), len) == 0)
+                return id;
+        }
+        return Interner::NOT_FOUND;
+    }
+
+    std::string name(const uint64_t *name_begin, uint32_t id) const
+    {
+        return std::string(string_pool + name_begin[id],
+                           name_begin[id + 1] - name_begin[id]);
+    }
+
+    // A section of the image being built, to fill in
+    template <typename T>
+    T *out(ModelSection which)
+    {
+        char *base = reinterpret_cast<char *>(image.data());
+        return reinterpret_cast<T *>(base + header->section_begin[which]);
+    }
+
+    // Writes the label and word names, labels first, and their hash tables
+    void write_names(const CountTable &counts)
+    {
+        char *pool = out<char>(STRING_POOL);
+        uint64_t pool_used = counts.labels.pack_names(pool, 0,
+                                                      out<uint64_t>(LABEL_NAME_BEGIN));
+        counts.vocab.pack_names(pool, pool_used, out<uint64_t>(WORD_NAME_BEGIN));
+        counts.labels.fill_slots(out<uint32_t>(LABEL_SLOTS), header->label_slots);
+        counts.vocab.fill_slots(out<uint32_t>(WORD_SLOTS), header->word_slots);
+    }
+
+    // Writes the counts, name orders and log-probabilities of every label
+    //  and word
+    void write_counts(const CountTable &counts)
+    {
+        double post_count_double = counts.post_count;
+        ModelHeader *writable = reinterpret_cast<ModelHeader *>(image.data());
+        writable->log_never_seen = std::log(1.0 / post_count_double);
+
+        int32_t *label_counts = out<int32_t>(LABEL_POST_COUNT);
+        double *priors = out<double>(LOG_PRIOR);
+        for (uint32_t tag = 0; tag < header->num_labels; tag++)
+        {
+            double tag_post_count = counts.post_count_per_label[tag];
+            label_counts[tag] = counts.post_count_per_label[tag];
+            priors[tag] = std::log(tag_post_count / post_count_double);
+        }
+
+        int32_t *word_counts = out<int32_t>(WORD_POST_COUNT);
+        double *elsewhere = out<double>(LOG_SEEN_ELSEWHERE);
+        for (uint32_t word = 0; word < header->num_words; word++)
+        {
+            double word_post_count = counts.post_count_per_word[word];
+            word_counts[word] = counts.post_count_per_word[word];
+            elsewhere[word] = std::log(word_post_count / post_count_double);
+        }
+
+        std::vector<uint32_t> order = counts.labels.sorted_ids();
+        std::copy(order.begin(), order.end(), out<uint32_t>(LABEL_ORDER));
+        order = counts.vocab.sorted_ids();
+        std::copy(order.begin(), order.end(), out<uint32_t>(WORD_ORDER));
+    }
+
+    // Writes the (label, word) entries, bucketed by word and sorted by
+    //  label within each bucket
+    void write_entries(const CountTable &counts)
+    {
+        uint32_t num_words = header->num_words;
+        uint32_t *begin = out<uint32_t>(WORD_BEGIN);
+        std::unordered_map<uint64_t, int>::const_iterator it;
+        for (it = counts.label_word_freq_map.begin();
+             it != counts.label_word_freq_map.end(); it++)
+            begin[uint32_t(it->first) + 1]++;
+        for (uint32_t word = 0; word < num_words; word++)
+            begin[word + 1] += begin[word];
+
+        std::vector<uint32_t> next(begin, begin + num_words);
+        std::vector<std::pair<uint32_t, int>> entries(header->num_entries);
+        for (it = counts.label_word_freq_map.begin();
+             it != counts.label_word_freq_map.end(); it++)
+            entries[next[uint32_t(it->first)]++] = {uint32_t(it->first >> 32),
+                                                   it->second};
+        for (uint32_t word = 0; word < num_words; word++)
+            std::sort(entries.begin() + begin[word], entries.begin() + begin[word + 1]);
+
+        uint32_t *labels_out = out<uint32_t>(ENTRY_LABEL);
+        int32_t *counts_out = out<int32_t>(ENTRY_COUNT);
+        double *likelihoods = out<double>(ENTRY_LOG_LIKELIHOOD);
+        for (uint32_t i = 0; i < entries.size(); i++)
+        {
+            uint32_t tag = entries[i].first;
+            double tag_word_count = entries[i].second;
+            double tag_post_count = counts.post_count_per_label[tag];
+            labels_out[i] = tag;
+            counts_out[i] = entries[i].second;
+            likelihoods[i] = std::log(tag_word_count / tag_post_count);
+        }
+    }
+
+public:
+    FrozenModel() {}
+
+    ~FrozenModel()
+    {
+        release();
+    }
+
+    // Precomputes every log-probability classify needs from counts
+    void build(const CountTable &counts)
+    {
+        release();
+
+        ModelHeader head;
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+        head.version = MODEL_VERSION;
+        head.byte_order = MODEL_BYTE_ORDER;
+        head.post_count = counts.post_count;
+        head.num_entries = counts.label_word_freq_map.size();
+        head.num_labels = counts.labels.size();
+        head.num_words = counts.vocab.size();
+        head.label_slots = hash_slot_count(head.num_labels);
+        head.word_slots = hash_slot_count(head.num_words);
+        if (head.num_entries > UINT32_MAX)
+            throw model_exception("Too many (label, word) pairs for a model");
+        lay_out(head, counts.labels.names_size() + counts.vocab.names_size());
+
+        image.assign(head.file_size / sizeof(uint64_t), 0);
+        char *base = reinterpret_cast<char *>(image.data());
+        memcpy(base, &head, sizeof(head));
+        header = reinterpret_cast<const ModelHeader *>(base);
+        write_names(counts);
+        write_counts(counts);
+        write_entries(counts);
+        attach(base, head.file_size, "[in memory]");
+    }
+
+    // Whether the image was built in memory, so refresh() can update it
+    bool writable() const
+    {
+        return !image.empty();
+    }
+
+    // Updates a writable model in place after more posts were counted into
+    //  the counts it was built from, as long as no label, word or
+    //  (label, word) pair is new. Only the counts of changed_labels and
+    //  changed_words and the entries of changed_labels are recomputed. The
+    //  priors and fallbacks depend on the total post count, so they are
+    //  all recomputed. The result is identical to build(counts).
+    void refresh(const CountTable &counts, const std::vector<uint32_t> &changed_labels,
+                 const std::vector<uint32_t> &changed_words)
+    {
+        assert(writable());
+        char *base = reinterpret_cast<char *>(image.data());
+        ModelHeader *head = reinterpret_cast<ModelHeader *>(base);
+        auto out = [&](ModelSection which)
+        { return base + head->section_begin[which]; };
+
+        double post_count_double = counts.post_count;
+        head->post_count = counts.post_count;
+        head->log_never_seen = std::log(1.0 / post_count_double);
+
+        int32_t *label_counts = reinterpret_cast<int32_t *>(out(LABEL_POST_COUNT));
+        for (uint32_t tag : changed_labels)
+            label_counts[tag] = counts.post_count_per_label[tag];
+        double *priors = reinterpret_cast<double *>(out(LOG_PRIOR));
+        for (uint32_t tag = 0; tag < head->num_labels; tag++)
+        {
+            double tag_post_count = label_counts[tag];
+            priors[tag] = std::log(tag_post_count / post_count_double);
+        }
+
+        int32_t *word_counts = reinterpret_cast<int32_t *>(out(WORD_POST_COUNT));
+        for (uint32_t word : changed_words)
+            word_counts[word] = counts.post_count_per_word[word];
+        double *elsewhere = reinterpret_cast<double *>(out(LOG_SEEN_ELSEWHERE));
+        for (uint32_t word = 0; word < head->num_words; word++)
+        {
+            double word_post_count = word_counts[word];
+            elsewhere[word] = std::log(word_post_count / post_count_double);
+        }
+
+        if (label_entry_begin.empty())
+            index_entries_by_label();
+        int32_t *counts_out = reinterpret_cast<int32_t *>(out(ENTRY_COUNT));
+        double *likelihoods = reinterpret_cast<double *>(out(ENTRY_LOG_LIKELIHOOD));
+        for (uint32_t tag : changed_labels)
+        {
+            double tag_post_count = label_counts[tag];
+            for (uint32_t i = label_entry_begin[tag]; i < label_entry_begin[tag + 1]; i++)
+            {
+                uint32_t entry = label_entries[i].first;
+                uint32_t word = label_entries[i].second;
+                uint64_t key = label_word_key(tag, word);
+                counts_out[entry] = counts.label_word_freq_map.at(key);
+                double tag_word_count = counts_out[entry];
+                likelihoods[entry] = std::log(tag_word_count / tag_post_count);
+            }
+        }
+    }
+
+    // Sets counts to the counts this model was built from, with the same
+    //  label and word IDs, so more posts can be added to them
+    void thaw(CountTable &counts) const
+    {
+        counts = CountTable();
+        counts.post_count = header->post_count;
+        counts.unique_word_count = header->num_words;
+        for (uint32_t tag = 0; tag < header->num_labels; tag++)
+        {
+            counts.labels.intern(name(label_name_begin, tag));
+            counts.post_count_per_label.push_back(label_post_counts[tag]);
+        }
+        for (uint32_t word = 0; word < header->num_words; word++)
+        {
+            counts.vocab.intern(name(word_name_begin, word));
+            counts.post_count_per_word.push_back(word_post_counts[word]);
+        }
+        counts.label_word_freq_map.reserve(header->num_entries);
+        for (uint32_t word = 0; word < header->num_words; word++)
+        {
+            for (uint32_t entry = word_begin[word]; entry < word_begin[word + 1]; entry++)
+            {
+                counts.label_word_freq_map[label_word_key(entry_labels[entry], word)] =
+                    entry_counts[entry];
+            }
+        }
+    }
+
+    // Writes the model image to filename. Throws model_exception on failure.
+    void save(const std::string &filename) const
+    {
+        uint32_t byte_order = 1;
+        if (*reinterpret_cast<const char *>(&byte_order) != 1)
+            throw model_exception("Model files can only be written on "
+                                  "little-endian machines");
+        std::ofstream fout(filename.c_str(), std::ios::binary);
+        fout.write(reinterpret_cast<const char *>(header), header->file_size);
+        fout.close();
+        if (!fout)
+            throw model_exception("Error writing model: " + filename);
+    }
+
+    // Maps a model file written by save(). Throws model_exception if the
+    //  file cannot be opened or is not a valid model.
+    void load(const std::string &filename)
+    {
+        release();
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            throw model_exception("Error opening model: " + filename);
+        }
+        size_t size = st.st_size;
+        void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : MAP_FAILED;
+        close(fd);
+        if (data == MAP_FAILED)
+            throw model_exception("Not a model file: " + filename);
+        mapping = data;
+        mapping_size = size;
+        try
+        {
+            attach(static_cast<const char *>(data), size, filename);
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+    }
+
+    int post_count() const
+    {
+        return header->post_count;
+    }
+
+    uint32_t num_labels() const
+    {
+        return header->num_labels;
+    }
+
+    uint32_t num_words() const
+    {
+        return header->num_words;
+    }
+
+    // The number of (label, word) pairs seen in training
+    uint64_t num_entries() const
+    {
+        return header->num_entries;
+    }
+
+    // The size of the model image, as saved to a file
+    uint64_t byte_size() const
+    {
+        return header->file_size;
+    }
+
+    uint32_t find_label(std::string_view label) const
+    {
+        return find(label_slots, header->label_slots, label_name_begin, label);
+    }
+
+    uint32_t find_word(std::string_view word) const
+    {
+        return find(word_slots, header->word_slots, word_name_begin, word);
+    }
+
+    std::string label_name(uint32_t label) const
+    {
+        return name(label_name_begin, label);
+    }
+
+    std::string word_name(uint32_t word) const
+    {
+        return name(word_name_begin, word);
+    }
+
+    int label_post_count(uint32_t label) const
+    {
+        return label_post_counts[label];
+    }
+
+    // The i-th label or word ID in name order
+    uint32_t label_by_name(uint32_t i) const
+    {
+        return label_order[i];
+    }
+
+    uint32_t word_by_name(uint32_t i) const
+    {
+        return word_order[i];
+    }
+
+    double log_prior(uint32_t label) const
+    {
+        return log_priors[label];
+    }
+
+    // The contribution of a word that never occurs in training
+    double unseen_log_likelihood() const
+    {
+        return header->log_never_seen;
+    }
+
+    // The contribution of word to a label it never occurs with
+    double elsewhere_log_likelihood(uint32_t word) const
+    {
+        return log_seen_elsewhere[word];
+    }
+
+    // The seen (label, word) pairs for word are the entries
+    //  [entries_begin(word), entries_begin(word + 1))
+    uint32_t entries_begin(uint32_t word) const
+    {
+        return word_begin[word];
+    }
+
+    uint32_t entry_label(uint32_t entry) const
+    {
+        return entry_labels[entry];
+    }
+
+    int entry_count(uint32_t entry) const
+    {
+        return entry_counts[entry];
+    }
+
+    double entry_log_likelihood(uint32_t entry) const
+    {
+        return entry_log_likelihoods[entry];
+    }
+
+    // Returns the log-probability contribution of word to label
+    double log_likelihood(uint32_t label, uint32_t word) const
+    {
+        if (word == Interner::NOT_FOUND)
+            return header->log_never_seen;
+        const uint32_t *begin = entry_labels + word_begin[word];
+        const uint32_t *end = entry_labels + word_begin[word + 1];
+        const uint32_t *found = std::lower_bound(begin, end, label);
+        if (found != end && *found == label)
+            return entry_log_likelihoods[found - entry_labels];
+        return log_seen_elsewhere[word];
+    }
+
+    // Returns the log-probability score of a post with the given unique
+    //  word IDs for label, or -infinity for a label never trained on
+    double score(uint32_t label, const std::vector<uint32_t> &words) const
+    {
+        if (label == Interner::NOT_FOUND)
+            return -std::numeric_limits<double>::infinity();
+        double new_prob = log_priors[label];
+        for (uint32_t word : words)
+            new_prob += log_likelihood(label, word);
+        return new_prob;
+    }
+
+private:
+    // Disable copying because the tables point into this model's image
+    FrozenModel(const FrozenModel &);
+    FrozenModel &operator=(const FrozenModel &);
+};
+
+// Training posts as label and word IDs, in the order they were read. The
+//  word IDs of post p are post_words[post_word_begin[p], post_word_begin[p + 1]).
+//  IDs are given out in first-seen order, the same order a CountTable
+//  counting the posts gives them out in.
+struct TokenizedCorpus
+{
+    Interner labels;
+    Interner vocab;
+    std::vector<uint32_t> post_labels;
+    std::vector<uint64_t> post_word_begin = {0};
+    std::vector<uint32_t> post_words;
+
+    // Appends one post with label tag and the given unique words
+    void add_post(std::string_view tag, const std::vector<std::string_view> &words)
+    {
+        post_labels.push_back(labels.intern(tag));
+        for (std::string_view word : words)
+            post_words.push_back(vocab.intern(word));
+        post_word_begin.push_back(post_words.size());
+    }
+
+    // Appends the posts of other, which must come right after the ones
+    //  here. Labels and words new to this corpus get IDs in the order
+    //  other first saw them, as in CountTable::merge().
+    void append(const TokenizedCorpus &other)
+    {
+        std::vector<uint32_t> label_ids(other.labels.size());
+        for (uint32_t tag = 0; tag < other.labels.size(); tag++)
+            label_ids[tag] = labels.intern(other.labels.name(tag));
+        std::vector<uint32_t> word_ids(other.vocab.size());
+        for (uint32_t word = 0; word < other.vocab.size(); word++)
+            word_ids[word] = vocab.intern(other.vocab.name(word));
+
+        for (uint32_t tag : other.post_labels)
+            post_labels.push_back(label_ids[tag]);
+        for (uint32_t word : other.post_words)
+            post_words.push_back(word_ids[word]);
+        uint64_t offset = post_word_begin.back();
+        for (size_t post = 1; post < other.post_word_begin.size(); post++)
+            post_word_begin.push_back(offset + other.post_word_begin[post]);
+    }
+};
+
+// Training cache files hold the posts of a training file already split
+//  into label and word IDs, so training on the same file again skips
+//  parsing and tokenizing. Like model files, they are a header followed by
+//  the sections below, 8-byte aligned and little-endian, and are used in
+//  place once mapped.
+const char CACHE_MAGIC[8] = {'N', 'B', 'C', 'A', 'C', 'H', 'E', '\0'};
+const uint32_t CACHE_VERSION = 1;
+
+enum CacheSection
+{
+    CACHE_LABEL_NAME_BEGIN, // uint64_t[L + 1], offsets into CACHE_STRING_POOL
+    CACHE_WORD_NAME_BEGIN,  // uint64_t[V + 1], offsets into CACHE_STRING_POOL
+    CACHE_STRING_POOL,      // char[], the training file's path, every label
+                            //  name, then every word
+    CACHE_POST_LABEL,       // uint32_t[P], the label ID of each post
+    CACHE_POST_WORD_BEGIN,  // uint64_t[P + 1], offsets into CACHE_POST_WORDS
+    CACHE_POST_WORDS,       // uint32_t[T], the unique word IDs of each post
+    NUM_CACHE_SECTIONS
+};
+
+// A training file as it was when its posts were cached
+struct CacheSource
+{
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+};
+
+// The posts to save in a training cache: the posts of source_filename
+//  as source describes it, and at least how many distinct (label, word)
+//  pairs they have, to size the count table
+struct CachedPosts
+{
+    const std::string &source_filename;
+    const CacheSource &source;
+    const TokenizedCorpus &corpus;
+    uint64_t num_entries;
+};
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    CacheSource source;
+    uint64_t path_size;
+    uint64_t num_posts;
+    uint64_t num_tokens;
+    // at least the number of distinct (label, word) pairs, to size the
+    //  count table
+    uint64_t num_entries;
+    uint32_t num_labels;
+    uint32_t num_words;
+    uint64_t section_begin[NUM_CACHE_SECTIONS];
+    uint64_t section_size[NUM_CACHE_SECTIONS];
+};
+
+// A training cache file mapped into memory. Caches are only an
+//  optimization, so a missing, stale or unreadable one is reported by
+//  returning false rather than by throwing.
+class TrainingCache
+{
+private:
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    const CacheHeader *header = nullptr;
+    const uint64_t *label_name_begin = nullptr;
+    const uint64_t *word_name_begin = nullptr;
+    const char *string_pool = nullptr;
+    const uint32_t *post_labels = nullptr;
+    const uint64_t *post_word_begin = nullptr;
+    const uint32_t *post_words = nullptr;
+
+    template <typename T>
+    const T *section(const char *base, CacheSection which) const
+    {
+        return reinterpret_cast<const T *>(base + header->section_begin[which]);
+    }
+
+    // Fills in the header's section sizes and offsets from its counts
+    static void lay_out(CacheHeader &head, uint64_t string_pool_size)
+    {
+        uint64_t *size = head.section_size;
+        size[CACHE_LABEL_NAME_BEGIN] = (head.num_labels + 1) * sizeof(uint64_t);
+        size[CACHE_WORD_NAME_BEGIN] = (head.num_words + 1) * sizeof(uint64_t);
+        size[CACHE_STRING_POOL] = string_pool_size;
+        size[CACHE_POST_LABEL] = head.num_posts * sizeof(uint32_t);
+        size[CACHE_POST_WORD_BEGIN] = (head.num_posts + 1) * sizeof(uint64_t);
+        size[CACHE_POST_WORDS] = head.num_tokens * sizeof(uint32_t);
+
+        uint64_t offset = sizeof(CacheHeader);
+        for (int i = 0; i < NUM_CACHE_SECTIONS; i++)
+        {
+            offset = (offset + 7) / 8 * 8;
+            head.section_begin[i] = offset;
+            offset += size[i];
+        }
+        head.file_size = (offset + 7) / 8 * 8;
+    }
+
+    // Checks that data holds a complete cache image whose IDs and offsets
+    //  are all in range, and points every column into it
+    bool attach(const char *data, size_t size)
+    {
+        const CacheHeader *head = reinterpret_cast<const CacheHeader *>(data);
+        if (size < sizeof(CacheHeader) ||
+            memcmp(head->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+            head->version != CACHE_VERSION || head->byte_order != MODEL_BYTE_ORDER)
+            return false;
+        CacheHeader expected = *head;
+        lay_out(expected, head->section_size[CACHE_STRING_POOL]);
+        if (head->file_size != size ||
+            memcmp(&expected, head, sizeof(CacheHeader)) != 0)
+            return false;
+
+        header = head;
+        label_name_begin = section<uint64_t>(data, CACHE_LABEL_NAME_BEGIN);
+        word_name_begin = section<uint64_t>(data, CACHE_WORD_NAME_BEGIN);
+        string_pool = section<char>(data, CACHE_STRING_POOL);
+        post_labels = section<uint32_t>(data, CACHE_POST_LABEL);
+        post_word_begin = section<uint64_t>(data, CACHE_POST_WORD_BEGIN);
+        post_words = section<uint32_t>(data, CACHE_POST_WORDS);
+
+        bool ok = label_name_begin[0] == head->path_size &&
+                  word_name_begin[0] == label_name_begin[head->num_labels] &&
+                  word_name_begin[head->num_words] ==
+                      head->section_size[CACHE_STRING_POOL] &&
+                  post_word_begin[0] == 0 &&
+                  post_word_begin[head->num_posts] == head->num_tokens;
+        for (uint32_t tag = 0; ok && tag < head->num_labels; tag++)
+            ok = label_name_begin[tag] <= label_name_begin[tag + 1];
+        for (uint32_t word = 0; ok && word < head->num_words; word++)
+            ok = word_name_begin[word] <= word_name_begin[word + 1];
+        for (uint64_t post = 0; ok && post < head->num_posts; post++)
+        {
+            ok = post_labels[post] < head->num_labels &&
+                 post_word_begin[post] <= post_word_begin[post + 1];
+        }
+        for (uint64_t token = 0; ok && token < head->num_tokens; token++)
+            ok = post_words[token] < head->num_words;
+        if (!ok)
+            header = nullptr;
+        return ok;
+    }
+
+    void release()
+    {
+        if (mapping)
+            munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+        header = nullptr;
+    }
+
+    std::string_view name(const uint64_t *name_begin, uint32_t id) const
+    {
+        return std::string_view(string_pool + name_begin[id],
+                                name_begin[id + 1] - name_begin[id]);
+    }
+
+    // Lays out posts as a cache file image
+    static std::vector<uint64_t> image_of(const CachedPosts &posts)
+    {
+        const TokenizedCorpus &corpus = posts.corpus;
+        CacheHeader head;
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        head.version = CACHE_VERSION;
+        head.byte_order = MODEL_BYTE_ORDER;
+        head.source = posts.source;
+        head.path_size = posts.source_filename.size();
+        head.num_posts = corpus.post_labels.size();
+        head.num_tokens = corpus.post_words.size();
+        head.num_entries = posts.num_entries;
+        head.num_labels = corpus.labels.size();
+        head.num_words = corpus.vocab.size();
+        lay_out(head, head.path_size + corpus.labels.names_size() +
+                          corpus.vocab.names_size());
+
+        std::vector<uint64_t> image(head.file_size / sizeof(uint64_t), 0);
+        char *base = reinterpret_cast<char *>(image.data());
+        memcpy(base, &head, sizeof(head));
+        auto out = [&](CacheSection which)
+        { return base + head.section_begin[which]; };
+
+        char *pool = out(CACHE_STRING_POOL);
+        memcpy(pool, posts.source_filename.data(), head.path_size);
+        uint64_t pool_used = corpus.labels.pack_names(
+            pool, head.path_size,
+            reinterpret_cast<uint64_t *>(out(CACHE_LABEL_NAME_BEGIN)));
+        corpus.vocab.pack_names(pool, pool_used,
+                                reinterpret_cast<uint64_t *>(out(CACHE_WORD_NAME_BEGIN)));
+
+        std::copy(corpus.post_labels.begin(), corpus.post_labels.end(),
+                  reinterpret_cast<uint32_t *>(out(CACHE_POST_LABEL)));
+        std::copy(corpus.post_word_begin.begin(), corpus.post_word_begin.end(),
+                  reinterpret_cast<uint64_t *>(out(CACHE_POST_WORD_BEGIN)));
+        std::copy(corpus.post_words.begin(), corpus.post_words.end(),
+                  reinterpret_cast<uint32_t *>(out(CACHE_POST_WORDS)));
+        return image;
+    }
+
+public:
+    TrainingCache() {}
+
+    ~TrainingCache()
+    {
+        release();
+    }
+
+    // Sets source to the size, modification time and content hash of the
+    //  regular file filename. Returns false if it is not one or cannot be
+    //  read.
+    static bool describe(const std::string &filename, CacheSource &source)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : nullptr;
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        source.size = size;
+        source.mtime = st.st_mtime;
+        source.hash = hash_bytes(static_cast<const char *>(data), size);
+        if (data)
+            munmap(data, size);
+        return true;
+    }
+
+    // Maps cache_filename if it holds the posts of source_filename as
+    //  source describes it. Returns false if it is missing, out of date or
+    //  corrupt.
+    bool load(const std::string &cache_filename, const std::string &source_filename,
+              const CacheSource &source)
+    {
+        release();
+        int fd = open(cache_filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        mapping = data;
+        mapping_size = size;
+        madvise(data, size, MADV_SEQUENTIAL);
+        if (!attach(static_cast<const char *>(data), size) ||
+            memcmp(&header->source, &source, sizeof(source)) != 0 ||
+            std::string_view(string_pool, header->path_size) != source_filename)
+        {
+            release();
+            return false;
+        }
+        return true;
+    }
+
+    // Writes posts to cache_filename unless their training file changed
+    //  since posts.source described it. Writes to a temporary file first
+    //  so that a run reading the cache never sees half of one. Returns
+    //  false on failure.
+    static bool save(const std::string &cache_filename, const CachedPosts &posts)
+    {
+        uint32_t byte_order = 1;
+        struct stat st;
+        if (*reinterpret_cast<const char *>(&byte_order) != 1 ||
+            stat(posts.source_filename.c_str(), &st) != 0 ||
+            uint64_t(st.st_size) != posts.source.size ||
+            st.st_mtime != posts.source.mtime)
+            return false;
+
+        std::vector<uint64_t> image = image_of(posts);
+        const CacheHeader *head = reinterpret_cast<const CacheHeader *>(image.data());
+        std::string temp_filename = cache_filename + ".tmp" + std::to_string(getpid());
+        std::ofstream fout(temp_filename.c_str(), std::ios::binary);
+        fout.write(reinterpret_cast<const char *>(image.data()), head->file_size);
+        fout.close();
+        if (!fout || rename(temp_filename.c_str(), cache_filename.c_str()) != 0)
+        {
+            remove(temp_filename.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Counts every cached post into counts, which must be empty, giving the
+    //  same table as counting the training file's rows. Returns false if
+    //  the cache names a label or word twice.
+    bool count(CountTable &counts) const
+    {
+        for (uint32_t tag = 0; tag < header->num_labels; tag++)
+        {
+            bool added;
+            counts.labels.intern(name(label_name_begin, tag), added);
+            if (!added)
+                return false;
+        }
+        for (uint32_t word = 0; word < header->num_words; word++)
+        {
+            bool added;
+            counts.vocab.intern(name(word_name_begin, word), added);
+            if (!added)
+                return false;
+        }
+        counts.post_count_per_label.assign(header->num_labels, 0);
+        counts.post_count_per_word.assign(header->num_words, 0);
+        counts.unique_word_count = header->num_words;
+        counts.label_word_freq_map.reserve(header->num_entries);
+
+        for (uint64_t post = 0; post < header->num_posts; post++)
+        {
+            uint32_t tag = post_labels[post];
+            counts.post_count_per_label[tag]++;
+            for (uint64_t i = post_word_begin[post]; i < post_word_begin[post + 1]; i++)
+            {
+                counts.post_count_per_word[post_words[i]]++;
+                counts.label_word_freq_map[label_word_key(tag, post_words[i])]++;
+            }
+        }
+        counts.post_count = header->num_posts;
+        return true;
+    }
+
+    uint64_t num_posts() const
+    {
+        return header->num_posts;
+    }
+
+    uint64_t num_tokens() const
+    {
+        return header->num_tokens;
+    }
+
+private:
+    // Disable copying because the columns point into this cache's mapping
+    TrainingCache(const TrainingCache &);
+    TrainingCache &operator=(const TrainingCache &);
+};
+
+// The rows of a matrix to add up: num_rows indexes into a matrix of
+//  stride-wide rows
+struct MatrixRows
+{
+    const double *matrix;
+    size_t stride;
+    const uint32_t *rows;
+    size_t num_rows;
+};
+
+// Adds the listed matrix rows to scores, one stride-wide row each. Every
+//  kernel adds the rows to each label in the listed order, the same
+//  order FrozenModel::score() uses, so all of them give identical sums.
+typedef void (*AddRowsKernel)(const MatrixRows &in, double *scores);
+
+inline void add_rows_scalar(const MatrixRows &in, double *scores)
+{
+    for (size_t r = 0; r < in.num_rows; r++)
+    {
+        const double *row = in.matrix + in.rows[r] * in.stride;
+        for (size_t label = 0; label < in.stride; label++)
+            scores[label] += row[label];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2"))) static void add_rows_avx2(
+    const MatrixRows &in, double *scores)
+{
+    for (size_t label = 0; label < in.stride; label += 8)
+    {
+        __m256d low = _mm256_loadu_pd(scores + label);
+        __m256d high = _mm256_loadu_pd(scores + label + 4);
+        for (size_t r = 0; r < in.num_rows; r++)
+        {
+            const double *row = in.matrix + in.rows[r] * in.stride + label;
+            low = _mm256_add_pd(low, _mm256_loadu_pd(row));
+            high = _mm256_add_pd(high, _mm256_loadu_pd(row + 4));
+        }
+        _mm256_storeu_pd(scores + label, low);
+        _mm256_storeu_pd(scores + label + 4, high);
+    }
+}
+
+__attribute__((target("avx512f"))) static void add_rows_avx512(
+    const MatrixRows &in, double *scores)
+{
+    for (size_t label = 0; label < in.stride; label += 8)
+    {
+        __m512d sum = _mm512_loadu_pd(scores + label);
+        for (size_t r = 0; r < in.num_rows; r++)
+        {
+            const double *row = in.matrix + in.rows[r] * in.stride + label;
+            sum = _mm512_add_pd(sum, _mm512_loadu_pd(row));
+        }
+        _mm512_storeu_pd(scores + label, sum);
+    }
+}
+#endif
+
+// The model's log-likelihoods laid out as a dense word x label matrix, so
+//  that scoring a post starts from the row of priors and adds one row per
+//  word, for every label at once. Rows are padded to a multiple of 8
+//  labels so the SIMD kernels need no tail loop.
+class DenseScorer
+{
+public:
+    enum Isa
+    {
+        SCALAR,
+        AVX2,
+        AVX512
+    };
+
+    // The largest matrix build() will make, in cells. Models with more
+    //  words x labels than this are scored with FrozenModel::score().
+    static const size_t MAX_CELLS = size_t(1) << 24;
+
+    // The largest matrix worth building for any model, in cells, and
+    //  for larger ones how many cells per (label, word) entry
+    static const size_t SMALL_CELLS = size_t(1) << 18;
+    static const size_t CELLS_PER_ENTRY = 8;
+
+private:
+    // Rows [0, num_words) are the words, row num_words is a word never
+    //  seen in training, and row num_words + 1 holds the priors
+    std::vector<double> matrix;
+    size_t stride = 0;
+    uint32_t num_words = 0;
+    AddRowsKernel add_rows = add_rows_scalar;
+
+    // Writes every row of the matrix from model
+    void fill(const FrozenModel &model)
+    {
+        for (uint32_t word = 0; word < num_words; word++)
+        {
+            double *row = &matrix[word * stride];
+            std::fill(row, row + model.num_labels(),
+                      model.elsewhere_log_likelihood(word));
+            for (uint32_t entry = model.entries_begin(word);
+                 entry < model.entries_begin(word + 1); entry++)
+                row[model.entry_label(entry)] = model.entry_log_likelihood(entry);
+        }
+        double *unseen = &matrix[num_words * stride];
+        std::fill(unseen, unseen + model.num_labels(), model.unseen_log_likelihood());
+        double *priors = &matrix[(num_words + 1) * stride];
+        for (uint32_t tag = 0; tag < model.num_labels(); tag++)
+            priors[tag] = model.log_prior(tag);
+    }
+
+public:
+    static bool supported(Isa isa)
+    {
+#ifdef HAVE_X86_KERNELS
+        if (isa == AVX512)
+            return __builtin_cpu_supports("avx512f");
+        if (isa == AVX2)
+            return __builtin_cpu_supports("avx2");
+#endif
+        return isa == SCALAR;
+    }
+
+    // The widest instruction set this machine supports
+    static Isa best_isa()
+    {
+        if (supported(AVX512))
+            return AVX512;
+        if (supported(AVX2))
+            return AVX2;
+        return SCALAR;
+    }
+
+    // Lays out model as a matrix scored with isa, which must be supported.
+    //  Returns false, leaving the scorer empty, if the model is too big.
+    bool build(const FrozenModel &model, Isa isa)
+    {
+        matrix.clear();
+        num_words = model.num_words();
+        stride = (model.num_labels() + 7) / 8 * 8;
+        if (stride * (num_words + uint64_t(2)) > MAX_CELLS)
+            return false;
+
+        matrix.assign(stride * (num_words + 2), 0);
+        fill(model);
+
+        add_rows = add_rows_scalar;
+#ifdef HAVE_X86_KERNELS
+        if (isa == AVX2)
+            add_rows = add_rows_avx2;
+        else if (isa == AVX512)
+            add_rows = add_rows_avx512;
+#endif
+        return true;
+    }
+
+    // Rewrites the matrix after model was refreshed in place, with the
+    //  same labels, words and entries as when it was built. Every cell is
+    //  rewritten: the total post count is in every prior and fallback.
+    void refresh(const FrozenModel &model)
+    {
+        assert(model.num_words() == num_words);
+        fill(model);
+    }
+
+    bool empty() const
+    {
+        return matrix.empty();
+    }
+
+    // Whether a matrix for model is small enough to be worth its memory
+    //  and build time. A model with few entries for its words x labels
+    //  would make a large matrix of mostly fallbacks, which the sparse
+    //  scorer handles in a fraction of the space.
+    static bool worthwhile(const FrozenModel &model)
+    {
+        uint64_t cells = (model.num_labels() + 7) / 8 * 8 *
+                         (model.num_words() + uint64_t(2));
+        return cells <= SMALL_CELLS || cells <= CELLS_PER_ENTRY * model.num_entries();
+    }
+
+    // Sets scores, indexed by label ID, to the log-probability score of a
+    //  post with the given unique word IDs for every label
+    void score_all(const std::vector<uint32_t> &words, std::vector<uint32_t> &rows,
+                   std::vector<double> &scores) const
+    {
+        rows.resize(words.size());
+        for (size_t i = 0; i < words.size(); i++)
+            rows[i] = words[i] == Interner::NOT_FOUND ? num_words : words[i];
+        const double *priors = &matrix[(num_words + 1) * stride];
+        scores.assign(priors, priors + stride);
+        add_rows({matrix.data(), stride, rows.data(), rows.size()}, scores.data());
+    }
+};
+
+// Scores a post for every label as a baseline shared by all labels, the
+//  sum of each word's log-likelihood for a label it was never seen with,
+//  plus the label's prior and a delta for each (label, word) pair seen in
+//  training, read from an inverted index of word -> [(label, delta)]. The
+//  work per post follows the number of seen pairs for its words rather
+//  than words x labels. The sums are associated differently from
+//  FrozenModel::score(), so they may differ from it in the last bits.
+class SparseScorer
+{
+private:
+    const FrozenModel *model = nullptr;
+
+    // log-likelihood minus the word's baseline, indexed like the model's
+    //  (label, word) entries
+    std::vector<double> deltas;
+
+    // The largest magnitude of any log-likelihood of each word, and of
+    //  any prior, for bounding rounding error
+    std::vector<double> word_magnitude;
+    double prior_magnitude = 0;
+
+public:
+    void build(const FrozenModel &frozen)
+    {
+        model = &frozen;
+        prior_magnitude = 0;
+        for (uint32_t tag = 0; tag < frozen.num_labels(); tag++)
+            prior_magnitude = std::max(prior_magnitude, std::abs(frozen.log_prior(tag)));
+
+        deltas.resize(frozen.entries_begin(frozen.num_words()));
+        word_magnitude.resize(frozen.num_words());
+        for (uint32_t word = 0; word < frozen.num_words(); word++)
+        {
+            double baseline = frozen.elsewhere_log_likelihood(word);
+            word_magnitude[word] = std::abs(baseline);
+            for (uint32_t entry = frozen.entries_begin(word);
+                 entry < frozen.entries_begin(word + 1); entry++)
+            {
+                double log_likelihood = frozen.entry_log_likelihood(entry);
+                deltas[entry] = log_likelihood - baseline;
+                word_magnitude[word] = std::max(word_magnitude[word],
+                                                std::abs(log_likelihood));
+            }
+        }
+    }
+
+    bool empty() const
+    {
+        return model == nullptr;
+    }
+
+    // Sets scores, indexed by label ID, to the approximate log-probability
+    //  score of a post with the given unique word IDs for every label.
+    //  Returns a bound on how far any of them can be from the score
+    //  FrozenModel::score() computes.
+    double score_all(const std::vector<uint32_t> &words,
+                     std::vector<double> &scores) const
+    {
+        double baseline = 0;
+        double magnitude = prior_magnitude;
+        for (uint32_t word : words)
+        {
+            if (word == Interner::NOT_FOUND)
+            {
+                baseline += model->unseen_log_likelihood();
+                magnitude += std::abs(model->unseen_log_likelihood());
+            }
+            else
+            {
+                baseline += model->elsewhere_log_likelihood(word);
+                magnitude += 3 * word_magnitude[word];
+            }
+        }
+
+        scores.resize(model->num_labels());
+        for (uint32_t tag = 0; tag < scores.size(); tag++)
+            scores[tag] = model->log_prior(tag) + baseline;
+        for (uint32_t word : words)
+        {
+            if (word == Interner::NOT_FOUND)
+                continue;
+            for (uint32_t entry = model->entries_begin(word);
+                 entry < model->entries_begin(word + 1); entry++)
+                scores[model->entry_label(entry)] += deltas[entry];
+        }
+
+        // each sum has at most 2 * words.size() + 2 rounded operations,
+        //  each off by at most DBL_EPSILON times the total magnitude
+        return 2 * (2 * words.size() + 4) * DBL_EPSILON * magnitude;
+    }
+};
+
+// A set of label IDs, one bit per label
+typedef std::vector<uint64_t> LabelMask;
+
+inline void allow_label(LabelMask &mask, uint32_t label, uint32_t num_labels)
+{
+    mask.resize((num_labels + 63) / 64);
+    mask[label / 64] |= uint64_t(1) << (label % 64);
+}
+
+inline bool label_allowed(const LabelMask &mask, uint32_t label)
+{
+    return label / 64 < mask.size() && ((mask[label / 64] >> (label % 64)) & 1);
+}
+
+// Labels with their log-probability scores, best first
+typedef std::vector<std::pair<uint32_t, double>> TopLabels;
+
+// What the classifier predicts for one post
+struct Prediction
+{
+    // The ID of the most likely label; see Indentifier::label_name
+    uint32_t label;
+    double log_probability;
+    // The best labels with their scores, if top-k reporting is on
+    TopLabels top_labels;
+};
+
+// The columns of a training or test file that the classifier reads
+const std::vector<std::string> TAG_CONTENT_COLUMNS = {"tag", "content"};
+
+// An input iterator over the (tag, content) rows of a csvstream, for
+//  training straight from a file. The strings in current are reused from
+//  row to row.
+class CsvRowIterator
+{
+private:
+    csvstream *csvin = nullptr;
+    std::vector<size_t> columns;
+    std::vector<std::string_view> fields;
+    std::pair<std::string, std::string> current;
+
+public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef std::pair<std::string, std::string> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const std::pair<std::string, std::string> *pointer;
+    typedef const std::pair<std::string, std::string> &reference;
+
+    // The end iterator
+    CsvRowIterator() {}
+
+    explicit CsvRowIterator(csvstream &csvin_in)
+        : csvin(&csvin_in), columns(csvin_in.column_indices(TAG_CONTENT_COLUMNS))
+    {
+        ++*this;
+    }
+
+    reference operator*() const
+    {
+        return current;
+    }
+
+    pointer operator->() const
+    {
+        return &current;
+    }
+
+    CsvRowIterator &operator++()
+    {
+        if (csvin->read_row(columns, fields))
+        {
+            current.first.assign(fields[0]);
+            current.second.assign(fields[1]);
+        }
+        else
+            csvin = nullptr;
+        return *this;
+    }
+
+    bool operator==(const CsvRowIterator &other) const
+    {
+        return csvin == other.csvin;
+    }
+
+    bool operator!=(const CsvRowIterator &other) const
+    {
+        return csvin != other.csvin;
+    }
+};
+
+// Collects text in a large buffer and hands it to an ostream in big
+//  writes when the buffer fills or on flush(), instead of flushing every
+//  line. Doubles are formatted like an ostream with precision 3 and
+//  default float formatting, but with to_chars instead of the locale.
+class OutputBuffer
+{
+private:
+    std::ostream &out;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+    // Makes room for at least n more chars
+    void reserve(size_t n)
+    {
+        if (buffer.size() - used < n)
+            flush();
+        if (buffer.size() < n)
+            buffer.resize(n);
+    }
+
+public:
+    explicit OutputBuffer(std::ostream &out_in, size_t capacity = 1 << 16)
+        : out(out_in), buffer(capacity) {}
+
+    ~OutputBuffer()
+    {
+        flush();
+    }
+
+    OutputBuffer &operator<<(std::string_view text)
+    {
+        reserve(text.size());
+        memcpy(buffer.data() + used, text.data(), text.size());
+        used += text.size();
+        return *this;
+    }
+
+    OutputBuffer &operator<<(char c)
+    {
+        reserve(1);
+        buffer[used++] = c;
+        return *this;
+    }
+
+    // Same as printf's %.3g
+    OutputBuffer &operator<<(double value)
+    {
+        const size_t max_length = 32;
+        reserve(max_length);
+        char *end = std::to_chars(buffer.data() + used, buffer.data() + used + max_length,
+                                  value, std::chars_format::general, 3).ptr;
+        used = end - buffer.data();
+        return *this;
+    }
+
+    template <typename Integer>
+    typename std::enable_if<std::is_integral<Integer>::value &&
+                                !std::is_same<Integer, char>::value,
+                            OutputBuffer &>::type
+    operator<<(Integer value)
+    {
+        const size_t max_length = 24;
+        reserve(max_length);
+        char *end = std::to_chars(buffer.data() + used, buffer.data() + used + max_length,
+                                  value).ptr;
+        used = end - buffer.data();
+        return *this;
+    }
+
+    void flush()
+    {
+        if (used)
+            out.write(buffer.data(), used);
+        used = 0;
+    }
+};
+
+// Wall and CPU time spent in each phase of a run and how much work each
+//  phase did, plus named counters such as table sizes
+class RunStats
+{
+public:
+    struct Phase
+    {
+        std::string name;
+        double wall_seconds = 0;
+        double cpu_seconds = 0;
+        size_t rows = 0;
+        size_t tokens = 0;
+    };
+
+    // The phase called name, added the first time it is asked for
+    Phase &phase(const std::string &name)
+    {
+        for (Phase &existing : phases)
+        {
+            if (existing.name == name)
+                return existing;
+        }
+        phases.push_back(Phase());
+        phases.back().name = name;
+        return phases.back();
+    }
+
+    void set_counter(const std::string &name, uint64_t value)
+    {
+        for (std::pair<std::string, uint64_t> &counter : counters)
+        {
+            if (counter.first == name)
+            {
+                counter.second = value;
+                return;
+            }
+        }
+        counters.push_back({name, value});
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << "stats:\n";
+        for (const Phase &timed : phases)
+        {
+            out << "  " << timed.name << ": wall = " << timed.wall_seconds
+                << " s, cpu = " << timed.cpu_seconds << " s";
+            if (timed.rows)
+                out << ", rows = " << timed.rows;
+            if (timed.tokens)
+                out << ", tokens = " << timed.tokens;
+            out << "\n";
+        }
+        for (const std::pair<std::string, uint64_t> &counter : counters)
+            out << "  " << counter.first << " = " << counter.second << "\n";
+    }
+
+private:
+    std::vector<Phase> phases;
+    std::vector<std::pair<std::string, uint64_t>> counters;
+};
+
+// Adds the time from construction to stop() to a phase of stats. Does
+//  nothing if stats is null, so timing costs nothing when it is off.
+class PhaseTimer
+{
+private:
+    RunStats::Phase *phase = nullptr;
+    std::chrono::steady_clock::time_point wall_start;
+    double cpu_start = 0;
+
+    // CPU time used by every thread of the process so far
+    static double cpu_seconds()
+    {
+        timespec now;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+    }
+
+public:
+    PhaseTimer(RunStats *stats, const std::string &name)
+    {
+        if (!stats)
+            return;
+        phase = &stats->phase(name);
+        wall_start = std::chrono::steady_clock::now();
+        cpu_start = cpu_seconds();
+    }
+
+    ~PhaseTimer()
+    {
+        stop();
+    }
+
+    // Ends the phase, crediting it with rows rows and tokens tokens
+    void stop(size_t rows = 0, size_t tokens = 0)
+    {
+        if (!phase)
+            return;
+        std::chrono::duration<double> wall =
+            std::chrono::steady_clock::now() - wall_start;
+        phase->wall_seconds += wall.count();
+        phase->cpu_seconds += cpu_seconds() - cpu_start;
+        phase->rows += rows;
+        phase->tokens += tokens;
+        phase = nullptr;
+    }
+};
+
+class Indentifier
+{
+private:
+    bool debug;
+
+    // Where training summaries, debug output, predictions and errors go
+    std::ostream &sink;
+
+    // Buffers everything but errors on its way to sink. Public methods
+    //  flush it before they return.
+    mutable OutputBuffer output;
+
+    // Where phase timings and table sizes go, or null to not collect them
+    RunStats *stats = nullptr;
+
+    // Number of threads used to count training shards and score test posts
+    int threads;
+
+    // Everything counted from the training set
+    CountTable counts;
+
+    // Splits training posts into words
+    Tokenizer tokenizer;
+
+    // Whether counts is empty because the model was loaded from a file
+    bool counts_in_model = false;
+
+    // Whether train_on_file caches each training file's tokenized posts
+    //  next to it, and where train() records the posts it counts for the
+    //  cache, or null
+    bool use_cache = false;
+    TokenizedCorpus *recording = nullptr;
+
+    // Whether posts were added since the model was last built or
+    //  refreshed, and whether any of them added a label, word or
+    //  (label, word) pair, which needs a full rebuild
+    bool model_stale = false;
+    bool model_reshaped = false;
+
+    // The labels and words whose counts changed since the model was last
+    //  built or refreshed, listed once each
+    std::vector<uint32_t> changed_labels;
+    std::vector<uint32_t> changed_words;
+    std::vector<bool> label_changed;
+    std::vector<bool> word_changed;
+
+    // Log-probability tables for classify, built once training is done
+    //  or loaded from a model file
+    FrozenModel model;
+
+    // Every trained label ID, in the order they are scored. Name order, so
+    //  that ties go to the label whose name comes first.
+    std::vector<uint32_t> label_registry;
+
+    // The labels classify may predict, or empty for every label
+    LabelMask allowed_labels;
+
+    // How posts are scored: by looking up each (label, word) pair in the
+    //  model, with a dense matrix, or with the sparse inverted index.
+    //  AUTO uses the dense matrix if it is worthwhile for the model, and
+    //  the inverted index otherwise. DENSE uses the dense matrix if the
+    //  model fits in one, and the inverted index otherwise.
+    enum Kernel
+    {
+        AUTO,
+        LOOKUP,
+        DENSE,
+        SPARSE
+    };
+    Kernel kernel = AUTO;
+    DenseScorer::Isa dense_isa = DenseScorer::best_isa();
+    DenseScorer dense;
+    SparseScorer sparse;
+
+    // How many of the best labels to report for each post, or 0 for only
+    //  the best one
+    int top_k = 0;
+
+    // The word IDs of each post in the last classify_batch, reused
+    std::vector<std::vector<uint32_t>> batch_words;
+
+    // Sets ids to the word IDs of the unique words in str, in word order,
+    //  with NOT_FOUND for words that were never seen in training
+    void unique_word_ids(Tokenizer &tokenizer, std::string_view str,
+                         std::vector<uint32_t> &ids) const
+    {
+        const std::vector<std::string_view> &words = tokenizer.unique_words(str);
+        ids.resize(words.size());
+        for (size_t i = 0; i < words.size(); i++)
+            ids[i] = model.find_word(words[i]);
+    }
+
+    // Brings the model up to date and sets the first posts.size() entries
+    //  of batch_words to the word IDs of posts
+    void tokenize_batch(const std::vector<std::string_view> &posts)
+    {
+        refresh();
+        Tokenizer tokenizer;
+        batch_words.resize(std::max(batch_words.size(), posts.size()));
+        for (size_t i = 0; i < posts.size(); i++)
+            unique_word_ids(tokenizer, posts[i], batch_words[i]);
+    }
+
+    void print_debug()
+    {
+        output << "vocabulary size = " << model.num_words() << '\n'
+               << '\n';
+        output << "classes:" << '\n';
+
+        std::vector<uint32_t> label_rank(model.num_labels());
+        for (uint32_t i = 0; i < model.num_labels(); i++)
+        {
+            uint32_t current_tag = model.label_by_name(i);
+            label_rank[current_tag] = i;
+            double post_with_label_c = model.label_post_count(current_tag);
+            output << "  " << model.label_name(current_tag) << ", "
+                   << post_with_label_c
+                   << " examples, log-prior = " << model.log_prior(current_tag)
+                   << '\n';
+        }
+
+        // classifier parameters
+        output << "classifier parameters:" << '\n';
+
+        // order by (label name, word name) using the ranks of each name
+        std::vector<uint32_t> word_rank(model.num_words());
+        for (uint32_t i = 0; i < model.num_words(); i++)
+            word_rank[model.word_by_name(i)] = i;
+
+        std::vector<std::pair<uint64_t, uint32_t>> entries;
+        for (uint32_t word = 0; word < model.num_words(); word++)
+        {
+            for (uint32_t entry = model.entries_begin(word);
+                 entry < model.entries_begin(word + 1); entry++)
+            {
+                uint32_t tag = model.entry_label(entry);
+                entries.push_back({label_word_key(label_rank[tag], word_rank[word]),
+                                   entry});
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+
+        for (const std::pair<uint64_t, uint32_t> &entry : entries)
+        {
+            uint32_t current_tag = model.label_by_name(entry.first >> 32);
+            uint32_t current_word = model.word_by_name(uint32_t(entry.first));
+            double count = model.entry_count(entry.second);
+            output << "  " << model.label_name(current_tag) << ":"
+                   << model.word_name(current_word) << ", count = "
+                   << count << ", log-likelihood = "
+                   << model.entry_log_likelihood(entry.second) << '\n';
+        }
+        output << '\n';
+    }
+
+    // Sets scores to the approximate sparse scores of a post with the
+    //  given unique word IDs, and returns the score below which no label
+    //  in allowed can be among the k best, or -infinity if there are
+    //  fewer than k candidates
+    double sparse_threshold(const std::vector<uint32_t> &words, const LabelMask &allowed,
+                            size_t k, std::vector<double> &scores) const
+    {
+        // the k best scores so far, as a heap with the worst on top
+        thread_local std::vector<double> best;
+        double tolerance = sparse.score_all(words, scores);
+        best.clear();
+        for (uint32_t tag : label_registry)
+        {
+            if (!allowed.empty() && !label_allowed(allowed, tag))
+                continue;
+            if (best.size() < k)
+            {
+                best.push_back(scores[tag]);
+                std::push_heap(best.begin(), best.end(), std::greater<double>());
+            }
+            else if (scores[tag] > best.front())
+            {
+                std::pop_heap(best.begin(), best.end(), std::greater<double>());
+                best.back() = scores[tag];
+                std::push_heap(best.begin(), best.end(), std::greater<double>());
+            }
+        }
+        if (best.size() < k)
+            return -std::numeric_limits<double>::infinity();
+
+        // the k best exact scores are all within tolerance of these, so a
+        //  label more than twice the tolerance below the k-th cannot beat them
+        return best.front() - 2 * tolerance;
+    }
+
+    // Sets result to the most likely label for a post with the given unique
+    //  word IDs and its score, and its top labels to the k best labels with
+    //  their scores, best first. Only the labels in allowed are candidates,
+    //  or every label if it is empty. Ties go to the label whose name comes
+    //  first. With no candidates, as when nothing was trained, the label
+    //  is NOT_FOUND with a score of -infinity. The dense scores are exact;
+    //  of the sparse ones, only labels that could be among the best are
+    //  scored exactly.
+    void predict(const std::vector<uint32_t> &words, const LabelMask &allowed,
+                 size_t k, Prediction &result) const
+    {
+        // scratch space reused by every post scored on this thread
+        thread_local std::vector<uint32_t> rows;
+        thread_local std::vector<double> scores;
+        thread_local std::vector<std::pair<double, uint32_t>> ranked;
+        size_t best = std::max(k, size_t(1));
+        auto better = [](const std::pair<double, uint32_t> &a,
+                         const std::pair<double, uint32_t> &b)
+        { return a.first > b.first || (a.first == b.first && a.second < b.second); };
+        double threshold = -std::numeric_limits<double>::infinity();
+        if (!dense.empty())
+            dense.score_all(words, rows, scores);
+        else if (!sparse.empty())
+            threshold = sparse_threshold(words, allowed, best, scores);
+
+        // (score, registry index) of the best labels so far, as a heap with
+        //  the worst on top
+        ranked.clear();
+        for (uint32_t i = 0; i < label_registry.size(); i++)
+        {
+            uint32_t tag = label_registry[i];
+            if (!allowed.empty() && !label_allowed(allowed, tag))
+                continue;
+            if (!sparse.empty() && scores[tag] < threshold)
+                continue;
+
+            // log prior plus the log likelihood of every unique word
+            std::pair<double, uint32_t> scored(
+                dense.empty() ? model.score(tag, words) : scores[tag], i);
+            if (ranked.size() < best)
+            {
+                ranked.push_back(scored);
+                std::push_heap(ranked.begin(), ranked.end(), better);
+            }
+            else if (better(scored, ranked.front()))
+            {
+                std::pop_heap(ranked.begin(), ranked.end(), better);
+                ranked.back() = scored;
+                std::push_heap(ranked.begin(), ranked.end(), better);
+            }
+        }
+
+        std::sort_heap(ranked.begin(), ranked.end(), better);
+        bool found = !ranked.empty();
+        result.label = found ? label_registry[ranked[0].second] : Interner::NOT_FOUND;
+        result.log_probability = found ? ranked[0].first
+                                       : -std::numeric_limits<double>::infinity();
+        result.top_labels.clear();
+        for (size_t i = 0; i < std::min(k, ranked.size()); i++)
+        {
+            uint32_t tag = label_registry[ranked[i].second];
+            result.top_labels.push_back({tag, ranked[i].first});
+        }
+    }
+
+    // Predicts the first count posts of classify_list into results,
+    //  spread across the threads, from the allowed labels, or from
+    //  (*masks)[i] for post i if masks is not null. Each post only reads
+    //  the frozen model and writes its own result.
+    void predict_all(const std::vector<std::vector<uint32_t>> &classify_list,
+                     size_t count, std::vector<Prediction> &results,
+                     const std::vector<LabelMask> *masks = nullptr) const
+    {
+        results.resize(count);
+        parallel_for(count, threads, [&](size_t i)
+        {
+            const LabelMask &allowed = masks ? (*masks)[i] : allowed_labels;
+            predict(classify_list[i], allowed, top_k, results[i]);
+        });
+    }
+
+    void print_prediction(const std::string &correct_label,
+                          const Prediction &result,
+                          const std::string &content) const
+    {
+        const TopLabels &top_labels = result.top_labels;
+        output << "  "
+               << "correct = " << correct_label << ", predicted = ";
+        output << label_name(result.label) << ", log-probability score = "
+               << result.log_probability << '\n';
+        if (!top_labels.empty())
+        {
+            output << "  top " << top_labels.size() << " = ";
+            for (size_t i = 0; i < top_labels.size(); i++)
+            {
+                output << (i ? ", " : "") << model.label_name(top_labels[i].first)
+                       << " (" << top_labels[i].second << ")";
+            }
+            output << '\n';
+        }
+        output << "  "
+               << "content = " << content << '\n'
+               << '\n';
+    }
+
+    // Prints the first count results with their posts and correct labels,
+    //  and returns how many of them were predicted correctly
+    int print_predictions(const std::vector<std::string> &correct_labels,
+                          const std::vector<std::string> &post_contents,
+                          const std::vector<Prediction> &results,
+                          size_t count) const
+    {
+        int num_guessed_properly = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            print_prediction(correct_labels[i], results[i], post_contents[i]);
+            num_guessed_properly += guessed_properly(results[i], correct_labels[i]);
+        }
+        return num_guessed_properly;
+    }
+
+    // Whether result predicted correct_label. A post nothing was predicted
+    //  for never counts, even if its label was never trained either.
+    bool guessed_properly(const Prediction &result,
+                          const std::string &correct_label) const
+    {
+        return result.label != Interner::NOT_FOUND &&
+               result.label == model.find_label(correct_label);
+    }
+
+    void print_performance(int num_guessed_properly, int new_post_count) const
+    {
+        output << "performance: " << num_guessed_properly
+               << " / " << new_post_count
+               << " posts predicted correctly" << '\n';
+    }
+
+    // Precomputes every log-probability classify needs from the counts
+    void freeze()
+    {
+        PhaseTimer timer(stats, "freeze");
+        model.build(counts);
+        prepare_scoring();
+        clear_changes();
+    }
+
+    void clear_changes()
+    {
+        model_stale = false;
+        model_reshaped = false;
+        for (uint32_t tag : changed_labels)
+            label_changed[tag] = false;
+        for (uint32_t word : changed_words)
+            word_changed[word] = false;
+        changed_labels.clear();
+        changed_words.clear();
+    }
+
+    // Brings the model up to date with posts added since it was built,
+    //  without re-reading any of them. When only existing counts changed,
+    //  the model and scoring tables are rewritten in place, keeping their
+    //  memory and the label registry. That still costs O(labels + words
+    //  + pairs), and O(labels x words) for the dense matrix, however few
+    //  posts were added: the total post count is in every prior and every
+    //  fallback. Any new label, word or pair rebuilds the model from the
+    //  counts, as freeze() does.
+    void refresh()
+    {
+        if (!model_stale)
+            return;
+        if (model_reshaped || !model.writable())
+        {
+            freeze();
+            return;
+        }
+        PhaseTimer timer(stats, "refresh");
+        model.refresh(counts, changed_labels, changed_words);
+        if (!dense.empty())
+            dense.refresh(model);
+        else if (!sparse.empty())
+            sparse.build(model);
+        clear_changes();
+    }
+
+    // Sets up the label registry and scoring tables for the current model
+    void prepare_scoring()
+    {
+        label_registry.resize(model.num_labels());
+        for (uint32_t i = 0; i < model.num_labels(); i++)
+            label_registry[i] = model.label_by_name(i);
+
+        dense = DenseScorer();
+        sparse = SparseScorer();
+        if (kernel == LOOKUP)
+            return;
+        bool use_dense = kernel == DENSE ||
+                         (kernel == AUTO && DenseScorer::worthwhile(model));
+        if (use_dense && dense.build(model, dense_isa))
+            return;
+        dense = DenseScorer();
+        sparse.build(model);
+    }
+
+public:
+    void print_training_summary()
+    {
+        refresh();
+        output << "trained on " << model.post_count() << " examples\n";
+
+        if (!debug)
+        {
+            output << '\n';
+        }
+        else
+        {
+            print_debug();
+        }
+        output.flush();
+    }
+
+    // Output goes to sink_in. Starts with an empty model, which predicts
+    //  no label for every post, until one is trained or loaded.
+    Indentifier(bool debug_true, int num_threads = 1, std::ostream &sink_in = std::cout)
+        : sink(sink_in), output(sink_in)
+    {
+        debug = debug_true;
+        threads = num_threads;
+        model.build(counts);
+        prepare_scoring();
+    }
+
+    // Keeps the tokenized posts of each file train_on_file reads in
+    //  FILE.cache next to it, and trains from that cache instead while the
+    //  file is unchanged. Debug runs always read the file itself.
+    void set_training_cache(bool enabled)
+    {
+        use_cache = enabled;
+    }
+
+    // Also report the k best labels for each post, with their scores
+    void set_top_k(int k)
+    {
+        top_k = k;
+    }
+
+    // Collects phase timings into run_stats, which must outlive this
+    void set_stats(RunStats *run_stats)
+    {
+        stats = run_stats;
+    }
+
+    // Records the sizes of the counts and the model in the stats
+    void record_table_sizes() const
+    {
+        if (!stats)
+            return;
+        stats->set_counter("labels", model.num_labels());
+        stats->set_counter("vocabulary", model.num_words());
+        stats->set_counter("label_word_pairs", model.num_entries());
+        stats->set_counter("count_table_pairs", counts.label_word_freq_map.size());
+        stats->set_counter("model_bytes", model.byte_size());
+    }
+
+    void classify(std::string filename)
+    {
+        refresh();
+
+        std::vector<std::string> correct_labels;
+        std::vector<std::vector<uint32_t>> classify_list;
+        std::vector<Prediction> results;
+        std::vector<std::string> post_contents;
+        int new_post_count = 0;
+        // converts file into string stream
+        PhaseTimer read_timer(stats, "classify_read");
+        csvstream csvin(filename);
+        csvin.set_threads(threads);
+        Tokenizer tokenizer;
+
+        std::vector<size_t> columns = csvin.column_indices(TAG_CONTENT_COLUMNS);
+        std::vector<std::string_view> row;
+
+        while (csvin.read_row(columns, row))
+        {
+            correct_labels.emplace_back(row[0]);
+
+            // put everything in right here
+            post_contents.emplace_back(row[1]);
+            new_post_count++;
+        }
+        read_timer.stop(new_post_count);
+
+        PhaseTimer tokenize_timer(stats, "classify_tokenize");
+        size_t tokens = 0;
+        classify_list.resize(new_post_count);
+        for (int i = 0; i < new_post_count; i++)
+        {
+            unique_word_ids(tokenizer, post_contents[i], classify_list[i]);
+            tokens += classify_list[i].size();
+        }
+        tokenize_timer.stop(new_post_count, tokens);
+
+        // for every post in the new file
+        PhaseTimer score_timer(stats, "classify_score");
+        predict_all(classify_list, classify_list.size(), results);
+        score_timer.stop(new_post_count, tokens);
+
+        PhaseTimer output_timer(stats, "classify_output");
+        output
+            << "test data:" << '\n';
+        int num_guessed_properly = print_predictions(correct_labels, post_contents,
+                                                     results, new_post_count);
+        print_performance(num_guessed_properly, new_post_count);
+        output.flush();
+        output_timer.stop(new_post_count);
+    }
+
+    // Like classify, but scores and prints each row as soon as it is read,
+    //  so memory use does not grow with the size of the test file. With
+    //  more than one thread, rows are read and scored in small batches.
+    void classify_stream(std::string filename)
+    {
+        refresh();
+
+        const size_t batch_size = threads == 1 ? 1 : 256 * threads;
+        std::vector<std::string> correct_labels(batch_size);
+        std::vector<std::string> post_contents(batch_size);
+        std::vector<std::vector<uint32_t>> classify_list(batch_size);
+        std::vector<Prediction> results;
+        int new_post_count = 0;
+        int num_guessed_properly = 0;
+        csvstream csvin(filename);
+        csvin.set_threads(threads);
+        Tokenizer tokenizer;
+        std::vector<size_t> columns = csvin.column_indices(TAG_CONTENT_COLUMNS);
+        std::vector<std::string_view> row;
+
+        output << "test data:" << '\n';
+        bool more_rows = true;
+        while (more_rows)
+        {
+            PhaseTimer read_timer(stats, "classify_read");
+            size_t batch_count = 0;
+            while (batch_count < batch_size &&
+                   (more_rows = bool(csvin.read_row(columns, row))))
+            {
+                correct_labels[batch_count].assign(row[0]);
+                post_contents[batch_count].assign(row[1]);
+                batch_count++;
+            }
+            read_timer.stop(batch_count);
+
+            PhaseTimer tokenize_timer(stats, "classify_tokenize");
+            size_t tokens = 0;
+            for (size_t i = 0; i < batch_count; i++)
+            {
+                unique_word_ids(tokenizer, post_contents[i], classify_list[i]);
+                tokens += classify_list[i].size();
+            }
+            tokenize_timer.stop(batch_count, tokens);
+
+            PhaseTimer score_timer(stats, "classify_score");
+            predict_all(classify_list, batch_count, results);
+            score_timer.stop(batch_count, tokens);
+
+            PhaseTimer output_timer(stats, "classify_output");
+            num_guessed_properly += print_predictions(correct_labels, post_contents,
+                                                      results, batch_count);
+            output_timer.stop(batch_count);
+            new_post_count += batch_count;
+        }
+        print_performance(num_guessed_properly, new_post_count);
+        output.flush();
+    }
+
+    // Predicts every post in posts into results. Posts are split into
+    //  words the same way as training posts.
+    void classify_batch(const std::vector<std::string_view> &posts,
+                        std::vector<Prediction> &results)
+    {
+        tokenize_batch(posts);
+        predict_all(batch_words, posts.size(), results);
+    }
+
+    // Like classify_batch, but post i may only be predicted a label in
+    //  masks[i], or any label if masks[i] is empty, in place of the labels
+    //  set_allowed_labels allows. masks has one entry per post.
+    void classify_batch(const std::vector<std::string_view> &posts,
+                        const std::vector<LabelMask> &masks,
+                        std::vector<Prediction> &results)
+    {
+        assert(masks.size() == posts.size());
+        tokenize_batch(posts);
+        predict_all(batch_words, posts.size(), results, &masks);
+    }
+
+    // The name of a label ID from a Prediction, or an empty name for
+    //  NOT_FOUND, when there was no label to predict
+    std::string label_name(uint32_t label) const
+    {
+        if (label == Interner::NOT_FOUND)
+            return "";
+        return model.label_name(label);
+    }
+
+    // Counts a batch of (tag, content) training rows and returns how many
+    //  unique words they had. With more than one thread, the batch is split
+    //  into one shard per thread, each shard is counted into its own table,
+    //  and the tables are merged in order. Posts recorded for the training
+    //  cache are recorded by the shards too, and appended in order.
+    size_t count_batch(const std::vector<std::pair<std::string, std::string>> &batch)
+    {
+        size_t tokens = 0;
+        if (threads == 1)
+        {
+            for (const std::pair<std::string, std::string> &post : batch)
+            {
+                const std::vector<std::string_view> &words =
+                    tokenizer.unique_words(post.second);
+                counts.add_post(post.first, words);
+                tokens += words.size();
+                if (recording)
+                    recording->add_post(post.first, words);
+            }
+            return tokens;
+        }
+
+        std::vector<CountTable> shards(threads);
+        std::vector<TokenizedCorpus> shard_posts(recording ? threads : 0);
+        std::vector<size_t> shard_tokens(threads);
+        size_t shard_size = (batch.size() + threads - 1) / threads;
+        parallel_for(shards.size(), threads, [&](size_t shard)
+        {
+            size_t begin = std::min(batch.size(), shard * shard_size);
+            size_t end = std::min(batch.size(), begin + shard_size);
+            Tokenizer shard_tokenizer;
+            for (size_t i = begin; i < end; i++)
+            {
+                const std::vector<std::string_view> &words =
+                    shard_tokenizer.unique_words(batch[i].second);
+                shards[shard].add_post(batch[i].first, words);
+                shard_tokens[shard] += words.size();
+                if (recording)
+                    shard_posts[shard].add_post(batch[i].first, words);
+            }
+        }, 1);
+        for (size_t shard = 0; shard < shards.size(); shard++)
+        {
+            counts.merge(shards[shard]);
+            tokens += shard_tokens[shard];
+            if (recording)
+                recording->append(shard_posts[shard]);
+        }
+        return tokens;
+    }
+
+    // Trains on the (tag, content) string pairs from first up to last
+    template <typename RowIterator>
+    void train(RowIterator first, RowIterator last)
+    {
+        if (debug)
+            output << "training data:\n";
+
+        // rows are counted a batch at a time to bound memory use
+        const size_t batch_size = 1 << 16;
+        std::vector<std::pair<std::string, std::string>> batch;
+
+        while (first != last)
+        {
+            PhaseTimer read_timer(stats, "train_read");
+            batch.clear();
+            for (; first != last && batch.size() < batch_size; ++first)
+            {
+                const std::pair<std::string, std::string> &row = *first;
+
+                // debug stuff
+                if (debug)
+                {
+                    output << "  label = " << row.first << ", content = " << row.second
+                           << '\n';
+                }
+
+                batch.push_back(row);
+            }
+            read_timer.stop(batch.size());
+
+            // tokenizing and counting are interleaved, so they are timed as one
+            PhaseTimer count_timer(stats, "train_count");
+            size_t tokens = count_batch(batch);
+            count_timer.stop(batch.size(), tokens);
+        }
+        output.flush();
+
+        counts_in_model = false;
+        freeze();
+    }
+
+    // Trains on the posts cached in cache_filename, if they are the posts
+    //  of filename as source describes it. Returns false, having counted
+    //  nothing, if they are not.
+    bool train_on_cache(const std::string &cache_filename,
+                        const std::string &filename, const CacheSource &source)
+    {
+        PhaseTimer load_timer(stats, "train_cache_load");
+        TrainingCache cache;
+        CountTable cached;
+        if (!cache.load(cache_filename, filename, source))
+            return false;
+        load_timer.stop();
+
+        PhaseTimer count_timer(stats, "train_count");
+        if (!cache.count(cached))
+            return false;
+        if (counts.post_count == 0 && counts.labels.size() == 0)
+            counts = std::move(cached);
+        else
+            counts.merge(cached);
+        count_timer.stop(cache.num_posts(), cache.num_tokens());
+
+        counts_in_model = false;
+        freeze();
+        return true;
+    }
+
+    void train_on_file(std::string filename)
+    {
+        // debug output lists every row, so it needs the file itself
+        CacheSource source;
+        std::string cache_filename = filename + ".cache";
+        bool cacheable = false;
+        if (use_cache && !debug)
+        {
+            PhaseTimer hash_timer(stats, "train_cache_load");
+            cacheable = TrainingCache::describe(filename, source);
+        }
+        if (cacheable && train_on_cache(cache_filename, filename, source))
+            return;
+
+        // converts file into string stream
+        PhaseTimer open_timer(stats, "train_read");
+        csvstream csvin(filename);
+        csvin.set_threads(threads);
+        CsvRowIterator rows(csvin);
+        open_timer.stop();
+        TokenizedCorpus corpus;
+        recording = cacheable ? &corpus : nullptr;
+        train(rows, CsvRowIterator());
+        recording = nullptr;
+
+        // a cache that can't be written only costs the next run time
+        if (cacheable)
+        {
+            PhaseTimer save_timer(stats, "train_cache_save");
+            TrainingCache::save(cache_filename, {filename, source, corpus,
+                                                 counts.label_word_freq_map.size()});
+        }
+    }
+
+    // Adds one labeled post to the training counts. Amortized constant
+    //  time per word; the scoring tables catch up on the next refresh(),
+    //  once for all the posts added before it.
+    void add_example(const std::string &tag, const std::string &content)
+    {
+        if (counts_in_model)
+        {
+            model.thaw(counts);
+            counts_in_model = false;
+        }
+
+        uint32_t num_labels = counts.labels.size();
+        uint32_t num_words = counts.vocab.size();
+        size_t num_pairs = counts.label_word_freq_map.size();
+        const std::vector<std::string_view> &words = tokenizer.unique_words(content);
+        counts.add_post(tag, words);
+        model_stale = true;
+        model_reshaped = model_reshaped || counts.labels.size() != num_labels ||
+                         counts.vocab.size() != num_words ||
+                         counts.label_word_freq_map.size() != num_pairs;
+        if (model_reshaped)
+            return;
+
+        label_changed.resize(num_labels);
+        word_changed.resize(num_words);
+        uint32_t tag_id = counts.labels.find(tag);
+        if (!label_changed[tag_id])
+        {
+            label_changed[tag_id] = true;
+            changed_labels.push_back(tag_id);
+        }
+        for (std::string_view word : words)
+        {
+            uint32_t word_id = counts.vocab.find(word);
+            if (!word_changed[word_id])
+            {
+                word_changed[word_id] = true;
+                changed_words.push_back(word_id);
+            }
+        }
+    }
+
+    // Adds the (tag, content) string pairs from first up to last to the
+    //  counts, without re-reading anything trained on before
+    template <typename RowIterator>
+    void update(RowIterator first, RowIterator last)
+    {
+        if (debug)
+            output << "training data:\n";
+
+        for (; first != last; ++first)
+        {
+            if (debug)
+            {
+                output << "  label = " << first->first << ", content = "
+                       << first->second << '\n';
+            }
+            add_example(first->first, first->second);
+        }
+        output.flush();
+    }
+
+    void add_file(std::string filename)
+    {
+        PhaseTimer timer(stats, "update");
+        csvstream csvin(filename);
+        csvin.set_threads(threads);
+        update(CsvRowIterator(csvin), CsvRowIterator());
+    }
+
+    // Uses the model saved in filename instead of training
+    bool load_model(std::string filename)
+    {
+        PhaseTimer timer(stats, "load_model");
+        try
+        {
+            model.load(filename);
+        }
+        catch (const model_exception &e)
+        {
+            sink << e.what() << std::endl;
+            return false;
+        }
+        counts = CountTable();
+        counts_in_model = true;
+        prepare_scoring();
+        clear_changes();
+        return true;
+    }
+
+    // Chooses how posts are scored: "lookup" for per-pair model lookups,
+    //  "sparse" for the inverted index, or a dense matrix with the
+    //  "scalar", "avx2" or "avx512" kernel. "auto" picks the widest dense
+    //  kernel this machine supports for models small enough for a dense
+    //  matrix, and the inverted index for the rest. Call before training
+    //  or loading a model.
+    bool set_kernel(const std::string &name)
+    {
+        kernel = DENSE;
+        dense_isa = DenseScorer::best_isa();
+        if (name == "auto")
+            kernel = AUTO;
+        else if (name == "lookup")
+            kernel = LOOKUP;
+        else if (name == "sparse")
+            kernel = SPARSE;
+        else if (name == "scalar")
+            dense_isa = DenseScorer::SCALAR;
+        else if (name == "avx2")
+            dense_isa = DenseScorer::AVX2;
+        else if (name == "avx512")
+            dense_isa = DenseScorer::AVX512;
+        else
+            return false;
+        if (!DenseScorer::supported(dense_isa))
+        {
+            sink << "Kernel not supported on this machine: " << name << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Sets mask to the labels in names, for classify_batch. Call after
+    //  training or loading a model.
+    bool label_mask(const std::vector<std::string> &names, LabelMask &mask) const
+    {
+        LabelMask allowed;
+        for (const std::string &name : names)
+        {
+            uint32_t tag = model.find_label(name);
+            if (tag == Interner::NOT_FOUND)
+            {
+                sink << "Unknown label: " << name << std::endl;
+                return false;
+            }
+            allow_label(allowed, tag, model.num_labels());
+        }
+        mask = allowed;
+        return true;
+    }
+
+    // Restricts the labels classify may predict to names. Call after
+    //  training or loading a model.
+    bool set_allowed_labels(const std::vector<std::string> &names)
+    {
+        return label_mask(names, allowed_labels);
+    }
+
+    bool save_model(std::string filename)
+    {
+        refresh();
+        try
+        {
+            model.save(filename);
+        }
+        catch (const model_exception &e)
+        {
+            sink << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool test_files_work(std::string file1, std::string file2)
+    {
+        return test_file_works(file1) && test_file_works(file2);
+    }
+
+    bool test_file_works(std::string file)
+    {
+        PhaseTimer timer(stats, "test_files_work");
+        try
+        {
+            csvstream ming(file);
+        }
+        catch (const csvstream_exception &e)
+        {
+            sink << "Error opening file: " << file << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif // CLASSIFIER_H
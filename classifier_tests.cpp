@@ -0,0 +1,580 @@
+// Project UID db1f506d06d84ab787baf250c265e24e
+// uniqnames: mileslow and oboyleai
+#include "classifier.h"
+#include "unit_test_framework.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+static const vector<pair<string, string>> TRAIN_SMALL = {
+    {"euchre", "can the upcard ever be the left bower"},
+    {"euchre", "when would the dealer ever prefer a card to the upcard"},
+    {"euchre", "bob played the same card twice is he cheating"},
+    {"euchre", "how to remove a card from players hand"},
+    {"euchre", "anyone want to play some euchre"},
+    {"calculator", "how to assert rational invariants"},
+    {"calculator", "does stack need its own big three"},
+    {"calculator", "valgrind memory error not sure what it means"},
+};
+
+static const vector<string_view> TEST_SMALL = {
+    "my code segfaults when bob is the dealer",
+    "no rational explanation for this bug",
+    "countif function in stack class not working",
+};
+
+static string read_file(const string &filename)
+{
+    ifstream fin(filename);
+    ostringstream contents;
+    contents << fin.rdbuf();
+    return contents.str();
+}
+
+// The library writes the same bytes as main.exe when given a sink
+static string run_small(bool debug)
+{
+    ostringstream out;
+    Indentifier ident(debug, 1, out);
+    ident.train_on_file("train_small.csv");
+    ident.print_training_summary();
+    ident.classify("test_small.csv");
+    return out.str();
+}
+
+TEST(test_sink_matches_cli)
+{
+    ASSERT_EQUAL(run_small(false), read_file("test_small.out.correct"));
+}
+
+TEST(test_debug_sink_matches_cli)
+{
+    ASSERT_EQUAL(run_small(true), read_file("test_small_debug.out.correct"));
+}
+
+TEST(test_train_prints_nothing)
+{
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.train(TRAIN_SMALL.begin(), TRAIN_SMALL.end());
+    vector<Prediction> results;
+    ident.classify_batch(TEST_SMALL, results);
+    ASSERT_EQUAL(out.str(), "");
+}
+
+TEST(test_classify_batch)
+{
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.train(TRAIN_SMALL.begin(), TRAIN_SMALL.end());
+
+    vector<Prediction> results;
+    ident.classify_batch(TEST_SMALL, results);
+    ASSERT_EQUAL(results.size(), 3);
+    ASSERT_EQUAL(ident.label_name(results[0].label), "euchre");
+    ASSERT_EQUAL(ident.label_name(results[1].label), "calculator");
+    ASSERT_EQUAL(ident.label_name(results[2].label), "calculator");
+    ASSERT_ALMOST_EQUAL(results[0].log_probability, -13.7, 0.05);
+    ASSERT_TRUE(results[0].top_labels.empty());
+
+    // an empty batch leaves no results behind
+    ident.classify_batch({}, results);
+    ASSERT_TRUE(results.empty());
+}
+
+TEST(test_train_rows_matches_file)
+{
+    ostringstream out;
+    Indentifier from_rows(false, 1, out);
+    from_rows.train(TRAIN_SMALL.begin(), TRAIN_SMALL.end());
+    Indentifier from_file(false, 1, out);
+    from_file.train_on_file("train_small.csv");
+
+    vector<Prediction> rows_results;
+    vector<Prediction> file_results;
+    from_rows.classify_batch(TEST_SMALL, rows_results);
+    from_file.classify_batch(TEST_SMALL, file_results);
+    for (size_t i = 0; i < TEST_SMALL.size(); i++)
+    {
+        ASSERT_EQUAL(from_rows.label_name(rows_results[i].label),
+                     from_file.label_name(file_results[i].label));
+        ASSERT_EQUAL(rows_results[i].log_probability,
+                     file_results[i].log_probability);
+    }
+}
+
+TEST(test_update_matches_retraining)
+{
+    ostringstream out;
+    Indentifier all(false, 1, out);
+    all.train(TRAIN_SMALL.begin(), TRAIN_SMALL.end());
+
+    // the second half adds new words, the repeat only changes counts
+    Indentifier updated(false, 1, out);
+    updated.train(TRAIN_SMALL.begin(), TRAIN_SMALL.begin() + 4);
+    updated.update(TRAIN_SMALL.begin() + 4, TRAIN_SMALL.end());
+    all.update(TRAIN_SMALL.begin(), TRAIN_SMALL.begin() + 2);
+    updated.update(TRAIN_SMALL.begin(), TRAIN_SMALL.begin() + 2);
+
+    vector<Prediction> all_results;
+    vector<Prediction> updated_results;
+    all.classify_batch(TEST_SMALL, all_results);
+    updated.classify_batch(TEST_SMALL, updated_results);
+    for (size_t i = 0; i < TEST_SMALL.size(); i++)
+    {
+        ASSERT_EQUAL(all_results[i].label, updated_results[i].label);
+        ASSERT_EQUAL(all_results[i].log_probability,
+                     updated_results[i].log_probability);
+    }
+}
+
+// Trains on filename, with the training cache if use_cache, and returns
+//  the summary and predictions for the small test set. Sets rows_read to
+//  the number of rows read from the file itself.
+static string run_cached(const string &filename, bool use_cache,
+                         size_t &rows_read)
+{
+    ostringstream out;
+    RunStats stats;
+    Indentifier ident(false, 1, out);
+    ident.set_stats(&stats);
+    ident.set_training_cache(use_cache);
+    ident.train_on_file(filename);
+    rows_read = stats.phase("train_read").rows;
+    ident.print_training_summary();
+    ident.classify("test_small.csv");
+    return out.str();
+}
+
+TEST(test_training_cache_matches_file)
+{
+    const string file = "classifier_tests.out.csv";
+    const string cache = file + ".cache";
+    string text = read_file("train_small.csv");
+    ofstream(file) << text;
+    remove(cache.c_str());
+    size_t rows_read;
+    string expected = run_cached(file, false, rows_read);
+    ASSERT_FALSE(ifstream(cache).good());
+
+    // the first run writes the cache and the second trains from it
+    ASSERT_EQUAL(run_cached(file, true, rows_read), expected);
+    ASSERT_EQUAL(rows_read, TRAIN_SMALL.size());
+    ASSERT_TRUE(ifstream(cache).good());
+    ASSERT_EQUAL(run_cached(file, true, rows_read), expected);
+    ASSERT_EQUAL(rows_read, 0);
+
+    // an edit that keeps the size and the second of the modification time
+    //  is caught by the content hash
+    string cached = read_file(cache);
+    text[text.find("euchre")] = 'E';
+    ofstream(file) << text;
+    expected = run_cached(file, false, rows_read);
+    ASSERT_EQUAL(run_cached(file, true, rows_read), expected);
+    ASSERT_EQUAL(rows_read, TRAIN_SMALL.size());
+    ASSERT_TRUE(read_file(cache) != cached);
+    ASSERT_EQUAL(run_cached(file, true, rows_read), expected);
+    ASSERT_EQUAL(rows_read, 0);
+
+    // a cache that doesn't hold a training file is ignored and rewritten
+    ofstream(cache) << "not a cache";
+    ASSERT_EQUAL(run_cached(file, true, rows_read), expected);
+    ASSERT_EQUAL(rows_read, TRAIN_SMALL.size());
+    ASSERT_EQUAL(run_cached(file, true, rows_read), expected);
+    ASSERT_EQUAL(rows_read, 0);
+    remove(cache.c_str());
+}
+
+TEST(test_training_cache_after_other_training)
+{
+    // the cache holds only the posts of its own file, so a run that trained
+    //  on other posts first writes the same cache as a fresh run
+    const string file = "classifier_tests.out.csv";
+    const string cache = file + ".cache";
+    ofstream(file) << read_file("train_small.csv");
+    remove(cache.c_str());
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.set_training_cache(true);
+    ident.train(TRAIN_SMALL.begin() + 5, TRAIN_SMALL.end());
+    ident.train_on_file(file);
+    string cached = read_file(cache);
+    remove(cache.c_str());
+    size_t rows_read;
+    run_cached(file, true, rows_read);
+    ASSERT_EQUAL(read_file(cache), cached);
+
+    // and training from the cache after other posts counts them all
+    Indentifier from_cache(false, 1, out);
+    from_cache.set_training_cache(true);
+    RunStats stats;
+    from_cache.set_stats(&stats);
+    from_cache.train(TRAIN_SMALL.begin() + 5, TRAIN_SMALL.end());
+    from_cache.train_on_file(file);
+    ASSERT_EQUAL(stats.phase("train_read").rows, 3);
+    vector<Prediction> expected;
+    vector<Prediction> results;
+    ident.classify_batch(TEST_SMALL, expected);
+    from_cache.classify_batch(TEST_SMALL, results);
+    for (size_t i = 0; i < TEST_SMALL.size(); i++)
+    {
+        ASSERT_EQUAL(results[i].label, expected[i].label);
+        ASSERT_EQUAL(results[i].log_probability, expected[i].log_probability);
+    }
+    remove(cache.c_str());
+}
+
+TEST(test_training_cache_with_threads)
+{
+    // shards record their own posts, which must add up to the same cache
+    //  a single thread writes, and no cache phase is timed when it is off
+    const string file = "classifier_tests.out.csv";
+    const string cache = file + ".cache";
+    ofstream(file) << read_file("w16_projects_exam.csv");
+    remove(cache.c_str());
+    size_t rows_read;
+    run_cached(file, true, rows_read);
+    string serial = read_file(cache);
+    for (int threads : {2, 3, 7})
+    {
+        remove(cache.c_str());
+        ostringstream out;
+        Indentifier ident(false, threads, out);
+        ident.set_training_cache(true);
+        ident.train_on_file(file);
+        ASSERT_EQUAL(read_file(cache), serial);
+    }
+
+    ostringstream out;
+    RunStats stats;
+    Indentifier ident(false, 3, out);
+    ident.set_stats(&stats);
+    ident.train_on_file(file);
+    ostringstream printed;
+    stats.print(printed);
+    ASSERT_TRUE(printed.str().find("cache") == string::npos);
+    remove(cache.c_str());
+}
+
+TEST(test_top_k)
+{
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.set_top_k(2);
+    ident.train(TRAIN_SMALL.begin(), TRAIN_SMALL.end());
+
+    vector<Prediction> results;
+    ident.classify_batch(TEST_SMALL, results);
+    for (const Prediction &result : results)
+    {
+        ASSERT_EQUAL(result.top_labels.size(), 2);
+        ASSERT_EQUAL(result.top_labels[0].first, result.label);
+        ASSERT_EQUAL(result.top_labels[0].second, result.log_probability);
+        ASSERT_TRUE(result.top_labels[0].second >= result.top_labels[1].second);
+    }
+}
+
+TEST(test_classify_batch_per_post_masks)
+{
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.train(TRAIN_SMALL.begin(), TRAIN_SMALL.end());
+    LabelMask euchre, calculator;
+    ASSERT_TRUE(ident.label_mask({"euchre"}, euchre));
+    ASSERT_TRUE(ident.label_mask({"calculator"}, calculator));
+    ASSERT_FALSE(ident.label_mask({"poker"}, euchre));
+
+    // each post is restricted by its own mask, and an empty one allows all
+    vector<Prediction> results;
+    ident.classify_batch(TEST_SMALL, {calculator, euchre, LabelMask()}, results);
+    ASSERT_EQUAL(results.size(), 3);
+    ASSERT_EQUAL(ident.label_name(results[0].label), "calculator");
+    ASSERT_EQUAL(ident.label_name(results[1].label), "euchre");
+    ASSERT_EQUAL(ident.label_name(results[2].label), "calculator");
+
+    // the masks replace the labels set_allowed_labels allows
+    ASSERT_TRUE(ident.set_allowed_labels({"euchre"}));
+    ident.classify_batch(TEST_SMALL, {calculator, calculator, calculator}, results);
+    for (const Prediction &result : results)
+        ASSERT_EQUAL(ident.label_name(result.label), "calculator");
+}
+
+// Every label of model ranked by its score for words, best first, with
+//  ties going to the label whose name comes first
+static TopLabels full_ranking(const FrozenModel &model, const vector<uint32_t> &words)
+{
+    TopLabels ranking;
+    for (uint32_t i = 0; i < model.num_labels(); i++)
+    {
+        uint32_t tag = model.label_by_name(i);
+        ranking.push_back({tag, model.score(tag, words)});
+    }
+    stable_sort(ranking.begin(), ranking.end(),
+                [](const pair<uint32_t, double> &a, const pair<uint32_t, double> &b)
+                { return a.second > b.second; });
+    return ranking;
+}
+
+// Whether the top k labels the kernel picks for every post in test_file,
+//  after training on train_file, are the first k labels of the full
+//  ranking, and the prediction is the first of them
+static bool top_k_matches_full_ranking(const string &train_file,
+                                       const string &test_file, size_t k,
+                                       const string &kernel)
+{
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.set_kernel(kernel);
+    ident.set_top_k(k);
+    ident.train_on_file(train_file);
+
+    CountTable counts;
+    Tokenizer tokenizer;
+    csvstream train_csv(train_file);
+    vector<size_t> columns = train_csv.column_indices(TAG_CONTENT_COLUMNS);
+    vector<string_view> row;
+    while (train_csv.read_row(columns, row))
+        counts.add_post(row[0], tokenizer.unique_words(row[1]));
+    FrozenModel model;
+    model.build(counts);
+
+    vector<string> posts;
+    csvstream test_csv(test_file);
+    columns = test_csv.column_indices(TAG_CONTENT_COLUMNS);
+    while (test_csv.read_row(columns, row))
+        posts.emplace_back(row[1]);
+    vector<Prediction> results;
+    ident.classify_batch(vector<string_view>(posts.begin(), posts.end()), results);
+
+    for (size_t post = 0; post < posts.size(); post++)
+    {
+        vector<uint32_t> words;
+        for (string_view word : tokenizer.unique_words(posts[post]))
+            words.push_back(model.find_word(word));
+        TopLabels ranking = full_ranking(model, words);
+        ranking.resize(min(k, ranking.size()));
+        if (results[post].top_labels != ranking ||
+            results[post].label != ranking[0].first)
+            return false;
+    }
+    return true;
+}
+
+TEST(test_top_k_matches_full_ranking)
+{
+    // train_small.csv has 2 labels and w16_projects_exam.csv has 6
+    for (const char *kernel : {"auto", "sparse", "lookup"})
+    {
+        for (size_t k : {1, 2, 3, 5, 6, 7, 20})
+        {
+            ASSERT_TRUE(top_k_matches_full_ranking("train_small.csv", "test_small.csv",
+                                                   k, kernel));
+            ASSERT_TRUE(top_k_matches_full_ranking("w16_projects_exam.csv",
+                                                   "sp16_projects_exam.csv", k, kernel));
+        }
+    }
+}
+
+TEST(test_train_on_header_only_file)
+{
+    // nothing is trained, so nothing is predicted or counted as correct
+    const string file = "classifier_tests.out.csv";
+    ofstream(file) << "tag,content\n";
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.set_top_k(2);
+    ident.train_on_file(file);
+    ident.print_training_summary();
+    ident.classify("test_small.csv");
+    string text = out.str();
+    ASSERT_EQUAL(text.substr(0, 23), "trained on 0 examples\n\n");
+    ASSERT_TRUE(text.find("correct = euchre, predicted = , "
+                          "log-probability score = -inf\n") != string::npos);
+    ASSERT_TRUE(text.find("performance: 0 / 3 posts") != string::npos);
+
+    vector<Prediction> results;
+    ident.classify_batch(TEST_SMALL, results);
+    ASSERT_EQUAL(results.size(), TEST_SMALL.size());
+    for (const Prediction &result : results)
+    {
+        ASSERT_TRUE(result.label == Interner::NOT_FOUND);
+        ASSERT_EQUAL(ident.label_name(result.label), "");
+        ASSERT_TRUE(result.top_labels.empty());
+    }
+}
+
+TEST(test_untrained_model)
+{
+    // before anything is trained or loaded the model is empty
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    vector<Prediction> results;
+    ident.classify_batch(TEST_SMALL, results);
+    ASSERT_EQUAL(results.size(), TEST_SMALL.size());
+    for (const Prediction &result : results)
+    {
+        ASSERT_TRUE(result.label == Interner::NOT_FOUND);
+        ASSERT_EQUAL(ident.label_name(result.label), "");
+    }
+    ident.print_training_summary();
+    ASSERT_EQUAL(out.str().substr(0, 23), "trained on 0 examples\n\n");
+
+    const string file = "classifier_tests.out.model";
+    ASSERT_TRUE(ident.save_model(file));
+    Indentifier loaded(false, 1, out);
+    ASSERT_TRUE(loaded.load_model(file));
+    loaded.classify_batch(TEST_SMALL, results);
+    ASSERT_TRUE(results[0].label == Interner::NOT_FOUND);
+}
+
+// Saves a model trained on train_small.csv and returns the file's bytes
+static string saved_small_model(const string &filename)
+{
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ident.train_on_file("train_small.csv");
+    ASSERT_TRUE(ident.save_model(filename));
+    return read_file(filename);
+}
+
+// The table of type T in section which of a model image
+template <typename T>
+static T *model_section(string &image, ModelSection which)
+{
+    const ModelHeader *head = reinterpret_cast<const ModelHeader *>(image.data());
+    return reinterpret_cast<T *>(&image[head->section_begin[which]]);
+}
+
+// Whether loading image as a model fails cleanly, with every kernel
+static bool rejects_model(const string &filename, const string &image)
+{
+    ofstream(filename, ios::binary) << image;
+    for (const char *kernel : {"auto", "lookup", "sparse"})
+    {
+        ostringstream out;
+        Indentifier ident(false, 1, out);
+        ident.set_kernel(kernel);
+        if (ident.load_model(filename) ||
+            out.str().find("model file: " + filename) == string::npos)
+            return false;
+    }
+    return true;
+}
+
+TEST(test_load_model_rejects_corrupt_files)
+{
+    const string file = "classifier_tests.out.model";
+    const string good = saved_small_model(file);
+    {
+        ostringstream out;
+        Indentifier ident(false, 1, out);
+        ASSERT_TRUE(ident.load_model(file));
+    }
+    const ModelHeader *head = reinterpret_cast<const ModelHeader *>(good.data());
+    uint32_t num_words = head->num_words;
+
+    ASSERT_TRUE(rejects_model(file, good.substr(0, good.size() - 8)));
+    ASSERT_TRUE(rejects_model(file, good.substr(0, 20)));
+
+    string image = good;
+    model_section<uint32_t>(image, ENTRY_LABEL)[0] = 0x7fffffff;
+    ASSERT_TRUE(rejects_model(file, image));
+
+    image = good;
+    model_section<uint32_t>(image, WORD_BEGIN)[1] = 0xfffffff;
+    ASSERT_TRUE(rejects_model(file, image));
+
+    image = good;
+    model_section<uint64_t>(image, WORD_NAME_BEGIN)[num_words] += 1000;
+    ASSERT_TRUE(rejects_model(file, image));
+
+    image = good;
+    uint64_t *label_names = model_section<uint64_t>(image, LABEL_NAME_BEGIN);
+    label_names[1] = label_names[2] + 1;
+    ASSERT_TRUE(rejects_model(file, image));
+    remove(file.c_str());
+}
+
+TEST(test_load_model_rejects_inconsistent_tables)
+{
+    const string file = "classifier_tests.out.model";
+    const string good = saved_small_model(file);
+    const ModelHeader *head = reinterpret_cast<const ModelHeader *>(good.data());
+    uint32_t num_labels = head->num_labels;
+    uint32_t num_words = head->num_words;
+
+    string image = good;
+    uint32_t *order = model_section<uint32_t>(image, LABEL_ORDER);
+    order[0] = order[1];
+    ASSERT_TRUE(rejects_model(file, image));
+
+    image = good;
+    model_section<uint32_t>(image, WORD_ORDER)[0] = num_words;
+    ASSERT_TRUE(rejects_model(file, image));
+
+    // a full slot table would make a lookup of a missing name spin
+    image = good;
+    uint32_t *slots = model_section<uint32_t>(image, WORD_SLOTS);
+    for (uint32_t slot = 0; slot < head->word_slots; slot++)
+        slots[slot] = slot % num_words + 1;
+    ASSERT_TRUE(rejects_model(file, image));
+
+    image = good;
+    model_section<uint32_t>(image, LABEL_SLOTS)[0] = num_labels + 1;
+    ASSERT_TRUE(rejects_model(file, image));
+
+    // two words with the same name
+    image = good;
+    const uint64_t *names = model_section<uint64_t>(image, WORD_NAME_BEGIN);
+    char *pool = model_section<char>(image, STRING_POOL);
+    uint32_t other = 1;
+    while (names[other + 1] - names[other] != names[1] - names[0])
+        other++;
+    copy(pool + names[0], pool + names[1], pool + names[other]);
+    ASSERT_TRUE(rejects_model(file, image));
+
+    // the entries of a word out of label order
+    image = good;
+    const uint32_t *begin = model_section<uint32_t>(image, WORD_BEGIN);
+    uint32_t *labels = model_section<uint32_t>(image, ENTRY_LABEL);
+    uint32_t word = 0;
+    while (begin[word + 1] - begin[word] < 2)
+        word++;
+    swap(labels[begin[word]], labels[begin[word] + 1]);
+    ASSERT_TRUE(rejects_model(file, image));
+    remove(file.c_str());
+}
+
+TEST(test_errors_go_to_sink)
+{
+    ostringstream out;
+    Indentifier ident(false, 1, out);
+    ASSERT_FALSE(ident.test_file_works("no_such_file.csv"));
+    ASSERT_EQUAL(out.str(), "Error opening file: no_such_file.csv\n");
+}
+
+TEST(test_output_buffer_matches_ostream)
+{
+    const vector<double> values = {0, -0.0, 5, 0.5, -0.47, -0.981, -13.65,
+                                   -12.5, 99.95, 1234.5, 1e-5, 1e100};
+    ostringstream expected;
+    expected.precision(3);
+    ostringstream actual;
+    {
+        // a tiny buffer also checks that long text gets through whole
+        OutputBuffer output(actual, 4);
+        for (double value : values)
+        {
+            expected << "value = " << value << ", " << -42 << '\n';
+            output << "value = " << value << ", " << -42 << '\n';
+        }
+    }
+    ASSERT_EQUAL(actual.str(), expected.str());
+}
+
+TEST_MAIN()
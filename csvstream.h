@@ -14,10 +14,48 @@
 #include <sstream>
 #include <cassert>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <regex>
 #include <exception>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <cstdlib>
+#include <cerrno>
+
+// Memory-mapped and read-ahead input need POSIX file descriptors
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CSVSTREAM_HAVE_MMAP 1
+#endif
+
+// Compressed input is opt-in, so that programs including this header
+// don't have to link extra libraries.  Define CSVSTREAM_ZLIB and link -lz
+// to read gzip files, and define CSVSTREAM_ZSTD and link -lzstd to read
+// zstd files.  Without them, compressed files are reported as errors.
+#ifdef CSVSTREAM_ZLIB
+#include <zlib.h>
+#define CSVSTREAM_HAVE_ZLIB 1
+#endif
+#ifdef CSVSTREAM_ZSTD
+#include <zstd.h>
+#define CSVSTREAM_HAVE_ZSTD 1
+#endif
+
+// Block scanning for special characters uses x86 SIMD when available
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CSVSTREAM_HAVE_X86_SIMD 1
+#endif
 
 
 // A custom exception type
@@ -31,11 +69,112 @@ public:
 };
 
 
+// Reads a file descriptor front to back into two large buffers that take
+// turns, decompressing gzip or zstd input, which it recognizes by its magic
+// number.  With a background thread, reading and decompressing the next
+// part of the file overlaps with parsing the last one.  Without one, input
+// is read when it is asked for.  Regular files are read with pread(),
+// anything else (pipes, terminals) with read().
+class csv_read_ahead {
+public:
+  // Start reading fd, which is closed by the destructor
+  csv_read_ahead(int fd, size_t buffer_bytes, bool threaded);
+
+  // Stop the thread, even when it is waiting for a full buffer to be taken
+  // or for a pipe to be written to
+  ~csv_read_ahead();
+
+  // Wait for the next filled buffer and append it to out.  Return false at
+  // the end of the file, after a read error, or when the file can't be
+  // decompressed, in which case error() says why.
+  bool append_next(std::string &out);
+
+  // Why the file couldn't be decompressed, or empty
+  const std::string & error() const;
+
+private:
+  enum compression {PLAIN, GZIP, ZSTD};
+
+  void run();
+
+  // Wait until fd can be read without blocking.  Return false if the
+  // destructor asks the thread to stop first.
+  bool wait_readable();
+
+  // Read up to size bytes of the file as it is stored into buffer, all of
+  // them unless the file ends or is a pipe.  Return how many were read.
+  size_t read_raw(char *buffer, size_t size);
+
+  // Replace the contents of compressed with the next part of the file.
+  // Return false at the end of the file.
+  bool read_compressed();
+
+  // Read the start of the file and set up decompressing it
+  void detect_compression();
+
+  // Fill buffer with up to buffer_bytes characters of the file,
+  // decompressed.  Return how many, or 0 at the end of the file.
+  size_t fill(char *buffer);
+
+  int fd;
+  bool use_pread;
+  size_t offset;
+  size_t buffer_bytes;
+  bool threaded;
+
+  // The file as it is stored, between being read and being decompressed.
+  // Plain files only pass through it at the start.  stream_ended is true
+  // between gzip members or zstd frames, where the file may end.
+  bool detected;
+  compression format;
+  std::vector<char> compressed;
+  size_t compressed_pos;
+  size_t compressed_size;
+  bool stream_ended;
+  std::string failure;
+#ifdef CSVSTREAM_HAVE_ZLIB
+  z_stream gzip;
+#endif
+#ifdef CSVSTREAM_HAVE_ZSTD
+  ZSTD_DStream *zstd;
+#endif
+
+  // filled[i] is the number of characters in buffers[i] waiting to be
+  // taken, or 0 for the end of the file.  full[i] is true from when the
+  // thread has filled buffers[i] until append_next() has copied it.
+  char *buffers[2];
+  size_t filled[2];
+  bool full[2];
+  int next_to_take;
+  bool stopping;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread thread;
+
+  // Disable copying, the thread points to this object
+  csv_read_ahead(const csv_read_ahead &);
+  csv_read_ahead & operator= (const csv_read_ahead &);
+};
+
+
 // csvstream interface
 class csvstream {
 public:
+  // How the constructor from a filename reads the file.  MMAP maps non-empty
+  // regular files into memory and parses them in place, and reads anything
+  // else like PREFETCH.  PREFETCH reads the file ahead on a background
+  // thread, in large buffers, decompressing gzip and zstd files.  BUFFERED
+  // reads like PREFETCH, but on the calling thread as rows are read.
+  // STREAM reads the file as it is through an ifstream.
+  enum input_mode {STREAM, MMAP, PREFETCH, BUFFERED};
+
   // Constructor from filename. Throws csvstream_exception if open fails.
-  csvstream(const std::string &filename, char delimiter=',', bool strict=true);
+  csvstream(const std::string &filename, char delimiter=',', bool strict=true,
+            input_mode mode=MMAP);
+
+  // Size of each read-ahead buffer for PREFETCH and BUFFERED input
+  static inline size_t prefetch_bytes = 1 << 20;
 
   // Constructor from stream
   csvstream(std::istream &is, char delimiter=',', bool strict=true);
@@ -58,6 +197,27 @@ public:
   // header.
   csvstream & operator>> (std::vector<std::pair<std::string, std::string> >& row);
 
+  // Return the index in the header of each column name.  When a name appears
+  // more than once, use the last one, like operator>> does.  Throws
+  // csvstream_exception if a name isn't in the header.
+  std::vector<size_t> column_indices(const std::vector<std::string> &names) const;
+
+  // Read one row, keeping only the columns at the given indices from
+  // column_indices().  fields[i] is the value of column columns[i], viewing
+  // a buffer inside this csvstream that the next read overwrites.  Strict
+  // mode and errors work like operator>>.  The buffers are reused from row
+  // to row, so a memory-mapped file is read without allocating once they
+  // have grown to fit the longest row.
+  csvstream & read_row(const std::vector<size_t> &columns,
+                       std::vector<std::string_view> &fields);
+
+  // Parse a memory-mapped file on num_threads threads.  The rest of the file
+  // is split into chunks of about chunk_bytes, each thread parses one chunk
+  // at a time, and rows are still read one at a time and in file order, with
+  // the same line numbers in errors.  Memory use is bounded by the size of
+  // num_threads chunks.  Has no effect on files that aren't mapped.
+  void set_threads(int num_threads, size_t chunk_bytes = 1 << 20);
+
 private:
   // Filename.  Used for error messages.
   std::string filename;
@@ -82,9 +242,85 @@ private:
   // Store header column names
   std::vector<std::string> header;
 
+  // Memory-mapped file contents, used instead of is when map_begin is not
+  // null.  map_pos is the next unread character.  map_good plays the part
+  // of the stream state, for prefetched input too.
+  const char *map_begin;
+  size_t map_size;
+  const char *map_pos;
+  bool map_good;
+
+  // Reader for PREFETCH and BUFFERED input, used instead of is when not
+  // null.  The characters it has read so far that haven't been parsed
+  // start at prefetch_pos in prefetch_window.
+  std::unique_ptr<csv_read_ahead> prefetch;
+  std::string prefetch_window;
+  size_t prefetch_pos;
+  bool prefetch_done;
+
+  // The fields of the row read by read_row(), back to back, and the offset
+  // in row_buffer where each one ends.  Lines read from the stream are
+  // tokenized into row_data first.
+  std::string row_buffer;
+  std::vector<size_t> row_ends;
+  std::vector<std::string> row_data;
+
+  // Rows parsed ahead by set_threads() threads, one chunk of the file per
+  // thread: the fields of all of its rows back to back, the offset where
+  // each field ends, and how many fields each row has
+  struct parsed_chunk {
+    std::string buffer;
+    std::vector<size_t> ends;
+    std::vector<size_t> row_sizes;
+  };
+  std::vector<parsed_chunk> chunks;
+  int num_threads;
+  size_t chunk_bytes;
+
+  // The next parsed row to read: its chunk, its index in the chunk, and the
+  // index of its first field in the chunk
+  size_t chunk_index;
+  size_t chunk_row;
+  size_t chunk_field;
+
+  // One tokenized line.  Field i is chars[i ? ends[i - 1] : begin, ends[i]).
+  struct csvline {
+    const char *chars;
+    size_t begin;
+    const size_t *ends;
+    size_t size;
+  };
+
   // Process header, the first line of the file
   void read_header();
 
+  // Map filename into memory or start reading it ahead, as mode says.
+  // Return false if it can't be opened that way.
+  bool open_file(input_mode mode);
+
+  // Release the mapping, if any
+  void unmap_file();
+
+  // Read and tokenize one line from the mapped file or the stream
+  bool read_line(std::vector<std::string> &data);
+
+  // Tokenize one line of prefetched input with parse(pos, end), which
+  // works like read_csv_line().  When the line might go on past the input
+  // read so far, read more and parse it again.
+  template <typename Parse>
+  bool read_prefetched(const Parse &parse);
+
+  // Read and tokenize one line into line, from the parsed chunks when
+  // reading in parallel.  line is valid until the next read.
+  bool read_fields(csvline &line);
+
+  // Parse the next num_threads chunks of the mapped file in parallel.
+  // Return false at the end of the file.
+  bool parse_ahead();
+
+  // Throw csvstream_exception unless a row of row_size values fits the header
+  void check_row_size(size_t row_size) const;
+
   // Disable copying because copying streams is bad!
   csvstream(const csvstream &);
   csvstream & operator= (const csvstream &);
@@ -199,56 +435,824 @@ static bool read_csv_line(std::istream &is,
 }
 
 
-csvstream::csvstream(const std::string &filename, char delimiter, bool strict)
+// Return the first character in [pos, end) that ends a run of plain token
+// characters, or end if there is none.  Double quotes and backslashes always
+// end a run.  Outside of quotes, so do the delimiter and line endings.
+static const char * csv_find_special_scalar(const char *pos,
+                                            const char *end,
+                                            char delimiter,
+                                            bool quoted
+                                            ) {
+  if (quoted) {
+    while (pos != end && *pos != '"' && *pos != '\\') ++pos;
+  } else {
+    while (pos != end && *pos != '"' && *pos != '\\' && *pos != delimiter &&
+           *pos != '\n' && *pos != '\r') {
+      ++pos;
+    }
+  }
+  return pos;
+}
+
+
+#ifdef CSVSTREAM_HAVE_X86_SIMD
+// Same as csv_find_special_scalar(), comparing 32 characters at a time
+__attribute__((target("avx2")))
+static const char * csv_find_special_avx2(const char *pos,
+                                          const char *end,
+                                          char delimiter,
+                                          bool quoted
+                                          ) {
+  // Inside quotes, compare against a quote again instead of the characters
+  // that aren't special there
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i delim = _mm256_set1_epi8(quoted ? '"' : delimiter);
+  const __m256i newline = _mm256_set1_epi8(quoted ? '"' : '\n');
+  const __m256i carriage_return = _mm256_set1_epi8(quoted ? '"' : '\r');
+  while (end - pos >= 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+    __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, quote),
+                                   _mm256_cmpeq_epi8(block, backslash));
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, delim));
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, newline));
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, carriage_return));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+    if (mask) return pos + __builtin_ctz(mask);
+    pos += 32;
+  }
+
+  // Fewer than 32 characters left
+  return csv_find_special_scalar(pos, end, delimiter, quoted);
+}
+#endif
+
+
+// Same as csv_find_special_scalar(), using the widest block scanner this
+// machine supports
+static const char * csv_find_special(const char *pos,
+                                     const char *end,
+                                     char delimiter,
+                                     bool quoted
+                                     ) {
+  typedef const char * (*Scanner)(const char *, const char *, char, bool);
+#ifdef CSVSTREAM_HAVE_X86_SIMD
+  static const Scanner scan = __builtin_cpu_supports("avx2")
+    ? csv_find_special_avx2 : csv_find_special_scalar;
+#else
+  static const Scanner scan = csv_find_special_scalar;
+#endif
+  return scan(pos, end, delimiter, quoted);
+}
+
+
+// Read and tokenize one line from the characters between pos and end,
+// advancing pos past the line.  This is the same state machine as the
+// stream version above, with the same results, but it finds the special
+// characters a block at a time and appends the runs of plain characters
+// between them to a token all at once.
+static bool read_csv_line(const char *&pos,
+                          const char *end,
+                          std::vector<std::string> &data,
+                          char delimiter
+                          ) {
+
+  // Nothing extracted means failure, like the stream version
+  if (pos == end) return false;
+
+  // Add entry for first token, start with empty string
+  data.clear();
+  data.push_back(std::string());
+
+  bool quoted = false;
+  while (pos != end) {
+    const char *run = pos;
+    pos = csv_find_special(pos, end, delimiter, quoted);
+    data.back().append(run, pos);
+    if (pos == end) break;
+
+    char c = *pos++;
+    if (c == '"') {
+      // Change states when we see a double quote
+      quoted = !quoted;
+    } else if (c == '\\') {
+      // Keep the backslash, and add the escaped character no matter what
+      data.back() += c;
+      if (pos != end) data.back() += *pos++;
+    } else if (c == delimiter) {
+      // Only seen outside of quotes
+      data.push_back("");
+    } else {
+      // Line ending.  Consume a following \n too, which covers Windows
+      // (\r\n) line endings.
+      if (pos != end && *pos == '\n') ++pos;
+      return true;
+    }
+  }
+  return true;
+}
+
+
+// Read and tokenize one line from the characters between pos and end, like
+// the function above, but append the tokens back to back to buffer and the
+// offset where each one ends to ends
+static bool read_csv_line(const char *&pos,
+                          const char *end,
+                          std::string &buffer,
+                          std::vector<size_t> &ends,
+                          char delimiter
+                          ) {
+
+  // Nothing extracted means failure, like the stream version
+  if (pos == end) return false;
+
+  bool quoted = false;
+  while (pos != end) {
+    const char *run = pos;
+    pos = csv_find_special(pos, end, delimiter, quoted);
+    buffer.append(run, pos);
+    if (pos == end) break;
+
+    char c = *pos++;
+    if (c == '"') {
+      quoted = !quoted;
+    } else if (c == '\\') {
+      buffer += c;
+      if (pos != end) buffer += *pos++;
+    } else if (c == delimiter) {
+      ends.push_back(buffer.size());
+    } else {
+      if (pos != end && *pos == '\n') ++pos;
+      break;
+    }
+  }
+
+  // End the last token
+  ends.push_back(buffer.size());
+  return true;
+}
+
+
+// The helpers below find record boundaries in the middle of a mapped file
+// for parallel parsing.  Outside of an escape, every double quote toggles
+// the quoted state, and the escape state at a character depends only on
+// the run of backslashes right before it.  So the quoted state anywhere is
+// the parity of the unescaped quotes before it, which can be counted for
+// each chunk independently and then summed up.
+
+// Return whether the character at pos is escaped, looking no further back
+// than begin, which must be the start of a line
+static bool csv_escaped(const char *begin, const char *pos) {
+  const char *run = pos;
+  while (run != begin && run[-1] == '\\') --run;
+  return (pos - run) % 2 == 1;
+}
+
+
+// Return whether [pos, end) holds an odd number of unescaped double quotes
+static bool csv_quote_parity(const char *begin, const char *pos,
+                             const char *end) {
+  bool odd = false;
+  if (pos != end && csv_escaped(begin, pos)) ++pos;
+  while ((pos = csv_find_special(pos, end, '"', true)) != end) {
+    if (*pos == '"') {
+      odd = !odd;
+      ++pos;
+    } else {
+      // Skip the backslash and the character it escapes
+      pos += end - pos >= 2 ? 2 : 1;
+    }
+  }
+  return odd;
+}
+
+
+// Return the start of the first line that begins after pos, or end if there
+// is none.  quoted is the quoted state at pos.  Only a line ending right
+// after an ordinary character is taken to end a line, since a line ending
+// after another one might be the \n that read_csv_line() consumes with it.
+static const char * csv_next_line(const char *begin, const char *pos,
+                                  const char *end, bool quoted) {
+  bool escaped = csv_escaped(begin, pos);
+  for (; pos != end; ++pos) {
+    char c = *pos;
+    if (escaped) {
+      escaped = false;
+    } else if (c == '\\') {
+      escaped = true;
+    } else if (c == '"') {
+      quoted = !quoted;
+    } else if (!quoted && (c == '\n' || c == '\r') && pos != begin &&
+               pos[-1] != '\n' && pos[-1] != '\r') {
+      ++pos;
+      if (pos != end && *pos == '\n') ++pos;
+      return pos;
+    }
+  }
+  return end;
+}
+
+
+// Call work(i) for each i in [0, n), each on its own thread
+template <typename Work>
+static void csv_run_parallel(size_t n, const Work &work) {
+  std::vector<std::thread> helpers;
+  for (size_t i = 1; i < n; ++i) {
+    helpers.emplace_back([&work, i]() { work(i); });
+  }
+  work(0);
+  for (std::thread &helper : helpers) helper.join();
+}
+
+
+inline csv_read_ahead::csv_read_ahead(int fd, size_t buffer_bytes,
+                                      bool threaded)
+  : fd(fd),
+    use_pread(false),
+    offset(0),
+    buffer_bytes(buffer_bytes),
+    threaded(threaded),
+    detected(false),
+    format(PLAIN),
+    compressed(std::max(buffer_bytes, size_t(4))),
+    compressed_pos(0),
+    compressed_size(0),
+    stream_ended(false),
+#ifdef CSVSTREAM_HAVE_ZSTD
+    zstd(nullptr),
+#endif
+    next_to_take(0),
+    stopping(false) {
+#ifdef CSVSTREAM_HAVE_MMAP
+  struct stat info;
+  use_pread = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+#endif
+
+  // Page-aligned buffers, which aligned_alloc wants a multiple of in size.
+  // Without a thread, input goes straight into the caller's string.
+  const size_t page = 4096;
+  for (int i = 0; i < 2; ++i) {
+    buffers[i] = nullptr;
+    if (threaded) {
+      buffers[i] = static_cast<char *>(
+        std::aligned_alloc(page, (buffer_bytes + page - 1) / page * page));
+    }
+    filled[i] = 0;
+    full[i] = false;
+  }
+  if (threaded && (!buffers[0] || !buffers[1])) {
+    // the destructor won't run, so let go of what it would have
+    std::free(buffers[0]);
+    std::free(buffers[1]);
+#ifdef CSVSTREAM_HAVE_MMAP
+    close(fd);
+#endif
+    throw std::bad_alloc();
+  }
+  if (threaded) thread = std::thread([this]() { run(); });
+}
+
+
+inline csv_read_ahead::~csv_read_ahead() {
+  if (threaded) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+  }
+#ifdef CSVSTREAM_HAVE_MMAP
+  close(fd);
+#endif
+#ifdef CSVSTREAM_HAVE_ZLIB
+  if (detected && format == GZIP && failure.empty()) inflateEnd(&gzip);
+#endif
+#ifdef CSVSTREAM_HAVE_ZSTD
+  ZSTD_freeDStream(zstd);
+#endif
+  std::free(buffers[0]);
+  std::free(buffers[1]);
+}
+
+
+inline const std::string & csv_read_ahead::error() const {
+  return failure;
+}
+
+
+inline void csv_read_ahead::run() {
+  for (int i = 0; ; i = 1 - i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]() { return stopping || !full[i]; });
+      if (stopping) return;
+    }
+
+    size_t count = fill(buffers[i]);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      filled[i] = count;
+      full[i] = true;
+    }
+    changed.notify_all();
+    if (count == 0) return;
+  }
+}
+
+
+inline bool csv_read_ahead::wait_readable() {
+#ifdef CSVSTREAM_HAVE_MMAP
+  for (;;) {
+    // Readable, hung up or failed all mean read() won't block
+    struct pollfd readable = {fd, POLLIN, 0};
+    if (poll(&readable, 1, 100) != 0) return true;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) return false;
+  }
+#else
+  return true;
+#endif
+}
+
+
+inline size_t csv_read_ahead::read_raw(char *buffer, size_t size) {
+  // A pipe hands over what one read() gets so that rows written slowly
+  // aren't held up.  A read error ends the file like it does for an
+  // ifstream.
+  size_t count = 0;
+#ifdef CSVSTREAM_HAVE_MMAP
+  while (count < size) {
+    if (!use_pread && !wait_readable()) break;
+    ssize_t got = use_pread
+      ? pread(fd, buffer + count, size - count, offset)
+      : read(fd, buffer + count, size - count);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) break;
+    count += got;
+    offset += got;
+    if (!use_pread) break;
+  }
+#endif
+  return count;
+}
+
+
+inline bool csv_read_ahead::read_compressed() {
+  compressed_pos = 0;
+  compressed_size = read_raw(compressed.data(), compressed.size());
+  return compressed_size > 0;
+}
+
+
+inline void csv_read_ahead::detect_compression() {
+  detected = true;
+  while (compressed_size < 4) {
+    size_t got = read_raw(compressed.data() + compressed_size,
+                          compressed.size() - compressed_size);
+    if (got == 0) break;
+    compressed_size += got;
+  }
+
+  const unsigned char *magic =
+    reinterpret_cast<const unsigned char *>(compressed.data());
+  if (compressed_size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    format = GZIP;
+#ifdef CSVSTREAM_HAVE_ZLIB
+    gzip.zalloc = Z_NULL;
+    gzip.zfree = Z_NULL;
+    gzip.opaque = Z_NULL;
+    gzip.next_in = reinterpret_cast<Bytef *>(compressed.data());
+    gzip.avail_in = compressed_size;
+    if (inflateInit2(&gzip, 15 + 16) != Z_OK) failure = "can't start zlib";
+#else
+    failure = "reading gzip files needs CSVSTREAM_ZLIB";
+#endif
+  } else if (compressed_size >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+             magic[2] == 0x2f && magic[3] == 0xfd) {
+    format = ZSTD;
+#ifdef CSVSTREAM_HAVE_ZSTD
+    zstd = ZSTD_createDStream();
+    if (!zstd || ZSTD_isError(ZSTD_initDStream(zstd))) {
+      failure = "can't start zstd";
+    }
+#else
+    failure = "reading zstd files needs CSVSTREAM_ZSTD";
+#endif
+  }
+}
+
+
+inline size_t csv_read_ahead::fill(char *buffer) {
+  if (!detected) detect_compression();
+  if (!failure.empty()) return 0;
+
+  if (format == PLAIN) {
+    // Hand over what was read to look for a magic number first
+    size_t count = std::min(compressed_size - compressed_pos, buffer_bytes);
+    if (count == 0) return read_raw(buffer, buffer_bytes);
+    std::copy(compressed.data() + compressed_pos,
+              compressed.data() + compressed_pos + count, buffer);
+    compressed_pos += count;
+    return count;
+  }
+
+#ifdef CSVSTREAM_HAVE_ZLIB
+  if (format == GZIP) {
+    gzip.next_out = reinterpret_cast<Bytef *>(buffer);
+    gzip.avail_out = buffer_bytes;
+    while (gzip.avail_out > 0) {
+      if (gzip.avail_in == 0 && read_compressed()) {
+        gzip.next_in = reinterpret_cast<Bytef *>(compressed.data());
+        gzip.avail_in = compressed_size;
+      }
+      if (gzip.avail_in == 0 && stream_ended) break;
+
+      // With no input left, inflate() may still have output to give, or
+      // say there is none with Z_BUF_ERROR
+      int status = inflate(&gzip, Z_NO_FLUSH);
+      if (status == Z_STREAM_END) {
+        // Another member may follow, as in concatenated .gz files
+        stream_ended = true;
+        inflateReset(&gzip);
+      } else if (status == Z_OK) {
+        stream_ended = false;
+      } else {
+        failure = status == Z_BUF_ERROR ? "truncated gzip data"
+                                        : "corrupt gzip data";
+        inflateEnd(&gzip);
+        break;
+      }
+    }
+    return buffer_bytes - gzip.avail_out;
+  }
+#endif
+
+#ifdef CSVSTREAM_HAVE_ZSTD
+  if (format == ZSTD) {
+    ZSTD_outBuffer output = {buffer, buffer_bytes, 0};
+    while (output.pos < output.size) {
+      if (compressed_pos == compressed_size) read_compressed();
+      if (compressed_pos == compressed_size && stream_ended) break;
+
+      ZSTD_inBuffer input =
+        {compressed.data(), compressed_size, compressed_pos};
+      size_t output_before = output.pos;
+      size_t status = ZSTD_decompressStream(zstd, &output, &input);
+      bool progress =
+        output.pos != output_before || input.pos != compressed_pos;
+      compressed_pos = input.pos;
+      if (ZSTD_isError(status)) {
+        failure = "corrupt zstd data";
+        break;
+      }
+      // A frame is done when the decoder returns 0
+      stream_ended = status == 0;
+      if (!progress) {
+        failure = "truncated zstd data";
+        break;
+      }
+    }
+    return output.pos;
+  }
+#endif
+  return 0;
+}
+
+
+inline bool csv_read_ahead::append_next(std::string &out) {
+  if (!threaded) {
+    size_t size = out.size();
+    out.resize(size + buffer_bytes);
+    size_t count = fill(&out[size]);
+    out.resize(size + count);
+    return count > 0;
+  }
+
+  int i = next_to_take;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&]() { return full[i]; });
+  }
+
+  // The thread leaves a full buffer alone, so copy it without the lock.
+  // The empty buffer at the end of the file stays full for good.
+  size_t count = filled[i];
+  if (count == 0) return false;
+  out.append(buffers[i], count);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    full[i] = false;
+  }
+  changed.notify_all();
+  next_to_take = 1 - i;
+  return true;
+}
+
+
+inline csvstream::csvstream(const std::string &filename, char delimiter,
+                            bool strict, input_mode mode)
   : filename(filename),
     is(fin),
     delimiter(delimiter),
     strict(strict),
-    line_no(0) {
-
-  // Open file
-  fin.open(filename.c_str());
-  if (!fin.is_open()) {
-    throw csvstream_exception("Error opening file: " + filename);
+    line_no(0),
+    map_begin(nullptr),
+    map_size(0),
+    map_pos(nullptr),
+    map_good(false),
+    prefetch_pos(0),
+    prefetch_done(false),
+    num_threads(1),
+    chunk_bytes(0),
+    chunk_index(0),
+    chunk_row(0),
+    chunk_field(0) {
+
+  // Open file, mapping it or reading it ahead if we can
+  if (mode == STREAM || !open_file(mode)) {
+    fin.open(filename.c_str());
+    if (!fin.is_open()) {
+      throw csvstream_exception("Error opening file: " + filename);
+    }
   }
 
   // Process header
-  read_header();
+  try {
+    read_header();
+  } catch (...) {
+    unmap_file();
+    throw;
+  }
 }
 
 
-csvstream::csvstream(std::istream &is, char delimiter, bool strict)
+inline csvstream::csvstream(std::istream &is, char delimiter, bool strict)
   : filename("[no filename]"),
     is(is),
     delimiter(delimiter),
     strict(strict),
-    line_no(0) {
+    line_no(0),
+    map_begin(nullptr),
+    map_size(0),
+    map_pos(nullptr),
+    map_good(false),
+    prefetch_pos(0),
+    prefetch_done(false),
+    num_threads(1),
+    chunk_bytes(0),
+    chunk_index(0),
+    chunk_row(0),
+    chunk_field(0) {
   read_header();
 }
 
 
-csvstream::~csvstream() {
+inline csvstream::~csvstream() {
+  unmap_file();
   if (fin.is_open()) fin.close();
 }
 
 
-csvstream::operator bool() const {
+inline csvstream::operator bool() const {
+  if (map_begin || prefetch) return map_good;
   return static_cast<bool>(is);
 }
 
 
-std::vector<std::string> csvstream::getheader() const {
+// Return whether the regular file fd starts with a gzip or zstd magic number
+static bool is_compressed(int fd) {
+#ifdef CSVSTREAM_HAVE_MMAP
+  unsigned char magic[4] = {0, 0, 0, 0};
+  if (pread(fd, magic, sizeof(magic), 0) < 2) return false;
+  return (magic[0] == 0x1f && magic[1] == 0x8b) ||
+    (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+     magic[3] == 0xfd);
+#else
+  return false;
+#endif
+}
+
+
+inline bool csvstream::open_file(input_mode mode) {
+#ifdef CSVSTREAM_HAVE_MMAP
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  // Pipes, devices, empty files and compressed files aren't mapped, so
+  // they are read ahead
+  struct stat info;
+  void *mapping = MAP_FAILED;
+  if (mode == MMAP && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+      info.st_size > 0 && !is_compressed(fd)) {
+    mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (mapping == MAP_FAILED) {
+    prefetch.reset(new csv_read_ahead(fd, std::max(prefetch_bytes, size_t(1)),
+                                      mode != BUFFERED));
+    map_good = true;
+    return true;
+  }
+  close(fd);
+
+  // Rows are read front to back, once
+  madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+  map_begin = static_cast<const char *>(mapping);
+  map_size = info.st_size;
+  map_pos = map_begin;
+  map_good = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+inline void csvstream::unmap_file() {
+#ifdef CSVSTREAM_HAVE_MMAP
+  if (map_begin) munmap(const_cast<char *>(map_begin), map_size);
+#endif
+  map_begin = nullptr;
+}
+
+
+template <typename Parse>
+bool csvstream::read_prefetched(const Parse &parse) {
+  for (;;) {
+    const char *begin = prefetch_window.data() + prefetch_pos;
+    const char *end = prefetch_window.data() + prefetch_window.size();
+    const char *pos = begin;
+    bool read = parse(pos, end);
+
+    // A line is complete if it ended before the end of the window, since
+    // a \r\n could be split across reads
+    if (prefetch_done || (read && pos != end)) {
+      prefetch_pos = pos - prefetch_window.data();
+      return read;
+    }
+
+    // Drop the parsed characters and read more
+    prefetch_window.erase(0, prefetch_pos);
+    prefetch_pos = 0;
+    prefetch_done = !prefetch->append_next(prefetch_window);
+    if (prefetch_done && !prefetch->error().empty()) {
+      throw csvstream_exception("Error reading file: " + filename + ": " +
+                                prefetch->error());
+    }
+  }
+}
+
+
+inline bool csvstream::read_line(std::vector<std::string> &data) {
+  if (prefetch) {
+    map_good = read_prefetched([&](const char *&pos, const char *end) {
+      return read_csv_line(pos, end, data, delimiter);
+    });
+    return map_good;
+  }
+  if (!map_begin) return read_csv_line(is, data, delimiter);
+  if (num_threads == 1 && chunk_index == chunks.size()) {
+    map_good = read_csv_line(map_pos, map_begin + map_size, data, delimiter);
+    return map_good;
+  }
+
+  // Copy out a row parsed in parallel
+  csvline line;
+  if (!read_fields(line)) return false;
+  data.clear();
+  for (size_t i = 0; i < line.size; ++i) {
+    size_t begin = i == 0 ? line.begin : line.ends[i - 1];
+    data.emplace_back(line.chars + begin, line.ends[i] - begin);
+  }
+  return true;
+}
+
+
+inline bool csvstream::read_fields(csvline &line) {
+  if (map_begin && (num_threads > 1 || chunk_index < chunks.size())) {
+    // Hand out the next parsed row, parsing more when they run out
+    for (;;) {
+      if (chunk_index < chunks.size()) {
+        const parsed_chunk &chunk = chunks[chunk_index];
+        if (chunk_row < chunk.row_sizes.size()) {
+          line.chars = chunk.buffer.data();
+          line.begin = chunk_field == 0 ? 0 : chunk.ends[chunk_field - 1];
+          line.ends = chunk.ends.data() + chunk_field;
+          line.size = chunk.row_sizes[chunk_row];
+          chunk_field += line.size;
+          ++chunk_row;
+          map_good = true;
+          return true;
+        }
+        ++chunk_index;
+        chunk_row = 0;
+        chunk_field = 0;
+      } else if (!parse_ahead()) {
+        map_good = false;
+        return false;
+      }
+    }
+  }
+
+  row_buffer.clear();
+  row_ends.clear();
+  if (prefetch) {
+    map_good = read_prefetched([&](const char *&pos, const char *end) {
+      row_buffer.clear();
+      row_ends.clear();
+      return read_csv_line(pos, end, row_buffer, row_ends, delimiter);
+    });
+    if (!map_good) return false;
+  } else if (map_begin) {
+    map_good = read_csv_line(map_pos, map_begin + map_size, row_buffer,
+                             row_ends, delimiter);
+    if (!map_good) return false;
+  } else {
+    if (!read_csv_line(is, row_data, delimiter)) return false;
+    for (const std::string &datum : row_data) {
+      row_buffer += datum;
+      row_ends.push_back(row_buffer.size());
+    }
+  }
+  line.chars = row_buffer.data();
+  line.begin = 0;
+  line.ends = row_ends.data();
+  line.size = row_ends.size();
+  return true;
+}
+
+
+inline void csvstream::set_threads(int num_threads_in, size_t chunk_bytes_in) {
+  num_threads = std::max(num_threads_in, 1);
+  chunk_bytes = std::max(chunk_bytes_in, size_t(1));
+}
+
+
+inline bool csvstream::parse_ahead() {
+  const char *end = map_begin + map_size;
+  chunks.resize(num_threads);
+  chunk_index = chunks.size();
+  if (map_pos == end) return false;
+
+  // Split the next num_threads * chunk_bytes characters evenly.  map_pos is
+  // the start of a line, so the quoted state there is false.
+  size_t n = chunks.size();
+  size_t batch = std::min(static_cast<size_t>(end - map_pos), n * chunk_bytes);
+  std::vector<const char *> starts(n + 1);
+  for (size_t i = 0; i <= n; ++i) {
+    starts[i] = map_pos + batch * i / n;
+  }
+  std::vector<char> odd(n);
+  csv_run_parallel(n, [&](size_t i) {
+    odd[i] = csv_quote_parity(map_pos, starts[i], starts[i + 1]);
+  });
+  std::vector<char> quoted(n + 1, false);
+  for (size_t i = 1; i <= n; ++i) {
+    quoted[i] = quoted[i - 1] != odd[i - 1];
+  }
+
+  // Move each split forward to the start of a line.  Splits can move past
+  // later ones, leaving empty chunks.
+  std::vector<const char *> bounds(n + 1, map_pos);
+  csv_run_parallel(n, [&](size_t i) {
+    bounds[i + 1] = csv_next_line(map_pos, starts[i + 1], end, quoted[i + 1]);
+  });
+  for (size_t i = 1; i <= n; ++i) {
+    bounds[i] = std::max(bounds[i], bounds[i - 1]);
+  }
+
+  csv_run_parallel(n, [&](size_t i) {
+    parsed_chunk &chunk = chunks[i];
+    chunk.buffer.clear();
+    chunk.ends.clear();
+    chunk.row_sizes.clear();
+    const char *pos = bounds[i];
+    while (pos != bounds[i + 1]) {
+      size_t num_ends = chunk.ends.size();
+      read_csv_line(pos, bounds[i + 1], chunk.buffer, chunk.ends, delimiter);
+      chunk.row_sizes.push_back(chunk.ends.size() - num_ends);
+    }
+  });
+  map_pos = bounds[n];
+  chunk_index = 0;
+  chunk_row = 0;
+  chunk_field = 0;
+  return true;
+}
+
+
+inline std::vector<std::string> csvstream::getheader() const {
   return header;
 }
 
 
-csvstream & csvstream::operator>> (std::map<std::string, std::string>& row) {
+inline csvstream & csvstream::operator>> (std::map<std::string, std::string>& row) {
   // Clear input row
   row.clear();
 
   // Read one line from stream, bail out if we're at the end
   std::vector<std::string> data;
-  if (!read_csv_line(is, data, delimiter)) return *this;
+  if (!read_line(data)) return *this;
   line_no += 1;
 
   // When strict mode is disabled, coerce the length of the data.  If data is
@@ -259,14 +1263,7 @@ csvstream & csvstream::operator>> (std::map<std::string, std::string>& row) {
   }
 
   // Check length of data
-  if (data.size() != header.size()) {
-    auto msg = "Number of items in row does not match header. " +
-      filename + ":L" + std::to_string(line_no) + " " +
-      "header.size() = " + std::to_string(header.size()) + " " +
-      "row.size() = " + std::to_string(data.size()) + " "
-      ;
-    throw csvstream_exception(msg);
-  }
+  check_row_size(data.size());
 
   // combine data and header into a row object
   for (size_t i=0; i<data.size(); ++i) {
@@ -277,14 +1274,14 @@ csvstream & csvstream::operator>> (std::map<std::string, std::string>& row) {
 }
 
 
-csvstream & csvstream::operator>> (std::vector<std::pair<std::string, std::string> >& row) {
+inline csvstream & csvstream::operator>> (std::vector<std::pair<std::string, std::string> >& row) {
   // Clear input row
   row.clear();
   row.resize(header.size());
 
   // Read one line from stream, bail out if we're at the end
   std::vector<std::string> data;
-  if (!read_csv_line(is, data, delimiter)) return *this;
+  if (!read_line(data)) return *this;
   line_no += 1;
 
   // When strict mode is disabled, coerce the length of the data.  If data is
@@ -313,9 +1310,63 @@ csvstream & csvstream::operator>> (std::vector<std::pair<std::string, std::strin
 }
 
 
-void csvstream::read_header() {
+inline std::vector<size_t>
+csvstream::column_indices(const std::vector<std::string> &names) const {
+  std::vector<size_t> columns;
+  for (const std::string &name : names) {
+    auto found = std::find(header.rbegin(), header.rend(), name);
+    if (found == header.rend()) {
+      throw csvstream_exception("Column not in header: " + name + " " +
+                                filename);
+    }
+    columns.push_back(header.rend() - found - 1);
+  }
+  return columns;
+}
+
+
+inline csvstream & csvstream::read_row(const std::vector<size_t> &columns,
+                                std::vector<std::string_view> &fields) {
+  fields.clear();
+
+  // Read one line, bail out if we're at the end
+  csvline line;
+  if (!read_fields(line)) return *this;
+  line_no += 1;
+
+  // Check the length of the data, as in operator>>.  When strict mode is
+  // disabled, columns past the end of the line are empty.
+  if (strict) {
+    check_row_size(line.size);
+  }
+
+  for (size_t column : columns) {
+    if (column < line.size) {
+      size_t begin = column == 0 ? line.begin : line.ends[column - 1];
+      fields.emplace_back(line.chars + begin, line.ends[column] - begin);
+    } else {
+      fields.emplace_back();
+    }
+  }
+  return *this;
+}
+
+
+inline void csvstream::check_row_size(size_t row_size) const {
+  if (row_size != header.size()) {
+    auto msg = "Number of items in row does not match header. " +
+      filename + ":L" + std::to_string(line_no) + " " +
+      "header.size() = " + std::to_string(header.size()) + " " +
+      "row.size() = " + std::to_string(row_size) + " "
+      ;
+    throw csvstream_exception(msg);
+  }
+}
+
+
+inline void csvstream::read_header() {
   // read first line, which is the header
-  if (!read_csv_line(is, header, delimiter)) {
+  if (!read_line(header)) {
     throw csvstream_exception("error reading header");
   }
 }
@@ -0,0 +1,560 @@
+// Project UID db1f506d06d84ab787baf250c265e24e
+// uniqnames: mileslow and oboyleai
+#include "csvstream.h"
+#include "unit_test_framework.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <csignal>
+
+using namespace std;
+
+// How a test opens a csvstream
+struct ReadOptions
+{
+    csvstream::input_mode mode;
+    bool strict = true;
+    int threads = 1;
+    size_t chunk_bytes = 1 << 20;
+};
+
+// Everything a csvstream reads from filename, including errors, as text
+static string read_all(const string &filename, const ReadOptions &options)
+{
+    ostringstream out;
+    try
+    {
+        csvstream csvin(filename, ',', options.strict, options.mode);
+        csvin.set_threads(options.threads, options.chunk_bytes);
+        for (const string &column : csvin.getheader())
+            out << "[" << column << "]";
+        out << "\n";
+        map<string, string> row;
+        while (csvin >> row)
+        {
+            for (const pair<const string, string> &item : row)
+                out << "{" << item.first << "=" << item.second << "}";
+            out << (csvin ? " good\n" : " bad\n");
+        }
+        out << (csvin ? "good" : "bad");
+    }
+    catch (const csvstream_exception &e)
+    {
+        out << "exception: " << e.what();
+    }
+    return out.str();
+}
+
+static string read_all(const string &filename, csvstream::input_mode mode,
+                       bool strict = true)
+{
+    return read_all(filename, {mode, strict});
+}
+
+static string read_file(const string &filename)
+{
+    ifstream fin(filename, ios::binary);
+    ostringstream contents;
+    contents << fin.rdbuf();
+    return contents.str();
+}
+
+// Every line read_csv_line() tokenizes from text, through the stream
+//  parser or the block parser
+static vector<vector<string>> parse_lines(const string &text, bool use_blocks)
+{
+    vector<vector<string>> lines;
+    vector<string> data;
+    if (use_blocks)
+    {
+        const char *pos = text.data();
+        while (read_csv_line(pos, text.data() + text.size(), data, ','))
+            lines.push_back(data);
+    }
+    else
+    {
+        istringstream in(text);
+        while (read_csv_line(in, data, ','))
+            lines.push_back(data);
+    }
+    return lines;
+}
+
+// Checks that the block scanner stops at the same characters as the scalar
+//  one, starting from every run in text
+static void check_scanner(const string &text)
+{
+    const char *end = text.data() + text.size();
+    for (bool quoted : {false, true})
+    {
+        for (const char *pos = text.data(); pos != end; pos++)
+        {
+            const char *expected = csv_find_special_scalar(pos, end, ',', quoted);
+            ASSERT_EQUAL(csv_find_special(pos, end, ',', quoted), expected);
+            pos = expected == end ? end - 1 : expected;
+        }
+    }
+}
+
+static void write_file(const string &filename, const string &contents)
+{
+    ofstream fout(filename, ios::binary);
+    fout << contents;
+}
+
+TEST(test_mmap_and_prefetch_match_stream_on_datasets)
+{
+    const vector<string> files = {
+        "train_small.csv", "test_small.csv", "w16_projects_exam.csv",
+        "sp16_projects_exam.csv", "w14-f15_instructor_student.csv",
+        "w16_instructor_student.csv"};
+    for (const string &file : files)
+    {
+        string expected = read_all(file, csvstream::STREAM);
+        ASSERT_EQUAL(read_all(file, csvstream::MMAP), expected);
+        ASSERT_EQUAL(read_all(file, csvstream::PREFETCH), expected);
+        ASSERT_EQUAL(read_all(file, csvstream::BUFFERED), expected);
+    }
+}
+
+TEST(test_mmap_and_prefetch_match_stream_on_edge_cases)
+{
+    const vector<string> inputs = {
+        "a,b\n1,2\n",
+        "a,b\n1,2",
+        "a,b\r\n1,2\r\n3,4\r\n",
+        "a,b\r1,2\r3,4",
+        "a,b\n\n1,2\n\n\n3,4\n",
+        "a,b\n\"x,y\",\"q\"\"r\"\n",
+        "a,b\n\"multi\nline\",2\n",
+        "a,b\n\\,,\"\\\"\"\n",
+        "a,b\nends with backslash,\\",
+        "a,b\n\"unterminated,2\n3,4\n",
+        "a,b\n1,2,3\n",
+        "a,b\n1\n",
+        "a\n",
+        "\n",
+        "a,b\n1,2\n\r\n",
+    };
+    for (const string &input : inputs)
+    {
+        write_file("csvstream_tests.out.csv", input);
+        for (bool strict : {true, false})
+        {
+            string expected = read_all("csvstream_tests.out.csv", csvstream::STREAM,
+                                       strict);
+            ASSERT_EQUAL(read_all("csvstream_tests.out.csv", csvstream::MMAP, strict),
+                         expected);
+            ASSERT_EQUAL(read_all("csvstream_tests.out.csv", csvstream::PREFETCH,
+                                  strict),
+                         expected);
+            ASSERT_EQUAL(read_all("csvstream_tests.out.csv", csvstream::BUFFERED,
+                                  strict),
+                         expected);
+        }
+    }
+}
+
+TEST(test_block_scanner_matches_scalar_on_datasets)
+{
+    const vector<string> files = {
+        "train_small.csv", "test_small.csv", "w16_projects_exam.csv",
+        "sp16_projects_exam.csv", "w14-f15_instructor_student.csv",
+        "w16_instructor_student.csv"};
+    for (const string &file : files)
+        check_scanner(read_file(file));
+}
+
+TEST(test_block_parser_matches_stream_on_fuzzed_inputs)
+{
+    // Mostly special characters, with lengths on both sides of a block
+    const string alphabet = "ab,\"\\\n\rxyz";
+    mt19937 random(20);
+    for (int i = 0; i < 5000; i++)
+    {
+        string text(random() % 100, ' ');
+        for (char &c : text)
+            c = alphabet[random() % alphabet.size()];
+        check_scanner(text);
+        ASSERT_EQUAL(parse_lines(text, true), parse_lines(text, false));
+    }
+}
+
+// The columns of every row in filename, from read_row() or operator>>
+static vector<vector<string>> read_columns(const string &filename,
+                                           const vector<string> &names,
+                                           const ReadOptions &options,
+                                           bool use_read_row)
+{
+    csvstream csvin(filename, ',', options.strict, options.mode);
+    vector<vector<string>> rows;
+    if (use_read_row)
+    {
+        vector<size_t> columns = csvin.column_indices(names);
+        vector<string_view> fields;
+        while (csvin.read_row(columns, fields))
+            rows.push_back(vector<string>(fields.begin(), fields.end()));
+    }
+    else
+    {
+        map<string, string> row;
+        while (csvin >> row)
+        {
+            rows.emplace_back();
+            for (const string &name : names)
+                rows.back().push_back(row[name]);
+        }
+    }
+    return rows;
+}
+
+TEST(test_read_row_matches_map_rows)
+{
+    const vector<string> files = {
+        "train_small.csv", "test_small.csv", "w16_projects_exam.csv",
+        "sp16_projects_exam.csv", "w14-f15_instructor_student.csv",
+        "w16_instructor_student.csv"};
+    const vector<string> names = {"content", "tag", "content"};
+    for (const string &file : files)
+    {
+        vector<vector<string>> expected =
+            read_columns(file, names, {csvstream::MMAP}, false);
+        ASSERT_EQUAL(read_columns(file, names, {csvstream::MMAP}, true), expected);
+        ASSERT_EQUAL(read_columns(file, names, {csvstream::STREAM}, true), expected);
+        ASSERT_EQUAL(read_columns(file, names, {csvstream::PREFETCH}, true), expected);
+    }
+}
+
+TEST(test_read_row_pads_and_checks_rows)
+{
+    write_file("csvstream_tests.out.csv", "a,b,a,c\n1,\"2\",3,4\n5,6\n7,8,9,10,11\n");
+    const vector<string> names = {"c", "a", "b"};
+    vector<vector<string>> expected = {{"4", "3", "2"}, {"", "", "6"}, {"10", "9", "8"}};
+    for (csvstream::input_mode mode :
+         {csvstream::MMAP, csvstream::STREAM, csvstream::PREFETCH})
+    {
+        ASSERT_EQUAL(read_columns("csvstream_tests.out.csv", names, {mode, false}, true),
+                     expected);
+
+        bool threw = false;
+        try
+        {
+            read_columns("csvstream_tests.out.csv", names, {mode}, true);
+        }
+        catch (const csvstream_exception &e)
+        {
+            threw = true;
+            ASSERT_EQUAL(string(e.what()),
+                         "Number of items in row does not match header. "
+                         "csvstream_tests.out.csv:L2 header.size() = 4 "
+                         "row.size() = 2 ");
+        }
+        ASSERT_TRUE(threw);
+    }
+}
+
+TEST(test_column_indices)
+{
+    csvstream csvin("train_small.csv");
+    ASSERT_EQUAL(csvin.column_indices({"content", "tag"}), vector<size_t>({3, 2}));
+    bool threw = false;
+    try
+    {
+        csvin.column_indices({"tag", "label"});
+    }
+    catch (const csvstream_exception &e)
+    {
+        threw = true;
+        ASSERT_EQUAL(string(e.what()), "Column not in header: label train_small.csv");
+    }
+    ASSERT_TRUE(threw);
+}
+
+TEST(test_parallel_matches_serial_on_datasets)
+{
+    const vector<string> files = {
+        "train_small.csv", "test_small.csv", "w16_projects_exam.csv",
+        "sp16_projects_exam.csv", "w14-f15_instructor_student.csv",
+        "w16_instructor_student.csv"};
+    for (const string &file : files)
+    {
+        string expected = read_all(file, csvstream::MMAP);
+        for (size_t chunk_bytes : {size_t(1000), size_t(1) << 16})
+        {
+            for (int threads : {2, 3})
+            {
+                ReadOptions options = {csvstream::MMAP, true, threads, chunk_bytes};
+                ASSERT_EQUAL(read_all(file, options), expected);
+            }
+        }
+    }
+
+    // read_row() takes the same parallel path as operator>>
+    csvstream serial("w16_projects_exam.csv");
+    csvstream parallel("w16_projects_exam.csv");
+    parallel.set_threads(4, 1000);
+    vector<size_t> columns = serial.column_indices({"content", "tag"});
+    vector<string_view> serial_fields;
+    vector<string_view> parallel_fields;
+    while (serial.read_row(columns, serial_fields))
+    {
+        ASSERT_TRUE(bool(parallel.read_row(columns, parallel_fields)));
+        ASSERT_EQUAL(parallel_fields, serial_fields);
+    }
+    ASSERT_FALSE(bool(parallel.read_row(columns, parallel_fields)));
+}
+
+TEST(test_parallel_matches_serial_on_fuzzed_inputs)
+{
+    // Tiny chunks put splits inside quotes, escapes and line endings
+    const string alphabet = "ab,\"\\\n\r\n\nxyz";
+    mt19937 random(22);
+    for (int i = 0; i < 500; i++)
+    {
+        string text = "a,b\n";
+        text.resize(text.size() + random() % 60, ' ');
+        for (size_t j = 4; j < text.size(); j++)
+            text[j] = alphabet[random() % alphabet.size()];
+        const string file = "csvstream_tests.out.csv";
+        write_file(file, text);
+        for (bool strict : {true, false})
+        {
+            string expected = read_all(file, csvstream::MMAP, strict);
+            for (size_t chunk_bytes : {1, 2, 3, 7})
+            {
+                ASSERT_EQUAL(read_all(file, {csvstream::MMAP, strict, 4, chunk_bytes}),
+                             expected);
+            }
+        }
+    }
+}
+
+TEST(test_parallel_error_line_numbers)
+{
+    // The bad row is in the second batch of chunks
+    string text = "a,b\n";
+    for (int i = 0; i < 50; i++)
+        text += "\"multi\nline\",\\\"\n";
+    text += "1,2,3\n4,5\n";
+    const string file = "csvstream_tests.out.csv";
+    write_file(file, text);
+    string parallel = read_all(file, {csvstream::MMAP, true, 3, 64});
+    ASSERT_EQUAL(parallel, read_all(file, csvstream::MMAP));
+    ASSERT_TRUE(parallel.find(":L51 ") != string::npos);
+}
+
+TEST(test_prefetch_matches_stream_on_fuzzed_inputs)
+{
+    // Tiny buffers split lines, \r\n pairs and escapes across reads
+    const string alphabet = "ab,\"\\\n\r\n\nxyz";
+    const string file = "csvstream_tests.out.csv";
+    const size_t prefetch_bytes = csvstream::prefetch_bytes;
+    mt19937 random(23);
+    for (int i = 0; i < 300; i++)
+    {
+        string text = "a,b\n";
+        text.resize(text.size() + random() % 60, ' ');
+        for (size_t j = 4; j < text.size(); j++)
+            text[j] = alphabet[random() % alphabet.size()];
+        write_file(file, text);
+        for (bool strict : {true, false})
+        {
+            string expected = read_all(file, csvstream::STREAM, strict);
+            for (size_t buffer_bytes : {1, 2, 3, 7})
+            {
+                csvstream::prefetch_bytes = buffer_bytes;
+                ASSERT_EQUAL(read_all(file, csvstream::PREFETCH, strict), expected);
+                ASSERT_EQUAL(read_all(file, csvstream::BUFFERED, strict), expected);
+            }
+            csvstream::prefetch_bytes = prefetch_bytes;
+        }
+    }
+}
+
+TEST(test_prefetch_reads_pipes)
+{
+    // A pipe can't be mapped, so MMAP reads it ahead instead
+    string text = read_file("w16_projects_exam.csv");
+    int fds[2];
+    ASSERT_EQUAL(pipe(fds), 0);
+    thread writer([&]()
+    {
+        for (size_t done = 0; done < text.size();)
+        {
+            ssize_t count = write(fds[1], text.data() + done, text.size() - done);
+            if (count <= 0)
+                break;
+            done += count;
+        }
+        close(fds[1]);
+    });
+    string piped = read_all("/dev/fd/" + to_string(fds[0]), csvstream::MMAP);
+
+    // Unblock the writer if the reader stopped early
+    signal(SIGPIPE, SIG_IGN);
+    close(fds[0]);
+    writer.join();
+    ASSERT_EQUAL(piped, read_all("w16_projects_exam.csv", csvstream::STREAM));
+}
+
+TEST(test_prefetch_stops_on_open_pipe)
+{
+    // Nothing more is written and the pipe stays open, so the read-ahead
+    //  thread must stop without seeing the end of the file
+    int fds[2];
+    ASSERT_EQUAL(pipe(fds), 0);
+    string text = "a,b\n1,2\n";
+    ASSERT_EQUAL(write(fds[1], text.data(), text.size()), ssize_t(text.size()));
+    {
+        csvstream csvin("/dev/fd/" + to_string(fds[0]));
+        ASSERT_EQUAL(csvin.getheader(), vector<string>({"a", "b"}));
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+#ifdef CSVSTREAM_HAVE_ZLIB
+// text as one gzip member
+static string gzip(const string &text)
+{
+    z_stream deflater = {};
+    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                 Z_DEFAULT_STRATEGY);
+    string compressed(deflateBound(&deflater, text.size()), '\0');
+    deflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+    deflater.avail_in = text.size();
+    deflater.next_out = reinterpret_cast<Bytef *>(&compressed[0]);
+    deflater.avail_out = compressed.size();
+    deflate(&deflater, Z_FINISH);
+    compressed.resize(deflater.total_out);
+    deflateEnd(&deflater);
+    return compressed;
+}
+
+TEST(test_gzip_matches_stream_on_datasets)
+{
+    const vector<string> files = {
+        "train_small.csv", "w16_projects_exam.csv", "w16_instructor_student.csv"};
+    const string file = "csvstream_tests.out.csv";
+    for (const string &plain : files)
+    {
+        string expected = read_all(plain, csvstream::STREAM);
+        write_file(file, gzip(read_file(plain)));
+        ASSERT_EQUAL(read_all(file, csvstream::MMAP), expected);
+        ASSERT_EQUAL(read_all(file, csvstream::PREFETCH), expected);
+        ASSERT_EQUAL(read_all(file, csvstream::BUFFERED), expected);
+        ASSERT_EQUAL(read_all(file, {csvstream::MMAP, true, 3, 4096}), expected);
+    }
+}
+
+TEST(test_gzip_members_and_small_buffers)
+{
+    // Concatenated members read as one file, like gzip -d does.  Tiny
+    //  buffers stop inflating in the middle of members and headers.
+    string text = read_file("train_small.csv");
+    string middle = text.substr(0, text.size() / 3);
+    const string file = "csvstream_tests.out.csv";
+    write_file(file, gzip(middle) + gzip("") + gzip(text.substr(middle.size())));
+    string expected = read_all("train_small.csv", csvstream::STREAM);
+    const size_t prefetch_bytes = csvstream::prefetch_bytes;
+    for (size_t buffer_bytes : {1, 2, 7, 4096})
+    {
+        csvstream::prefetch_bytes = buffer_bytes;
+        ASSERT_EQUAL(read_all(file, csvstream::PREFETCH), expected);
+        ASSERT_EQUAL(read_all(file, csvstream::BUFFERED), expected);
+    }
+    csvstream::prefetch_bytes = prefetch_bytes;
+}
+
+TEST(test_gzip_errors)
+{
+    string compressed = gzip(read_file("train_small.csv"));
+    const string file = "csvstream_tests.out.csv";
+    write_file(file, compressed.substr(0, compressed.size() / 2));
+    string truncated = read_all(file, csvstream::MMAP);
+    ASSERT_TRUE(truncated.find("exception: Error reading file: " + file +
+                               ": truncated gzip data") != string::npos);
+
+    compressed[compressed.size() / 2] ^= 0x55;
+    compressed[compressed.size() / 2 + 1] ^= 0x55;
+    write_file(file, compressed);
+    string corrupt = read_all(file, csvstream::BUFFERED);
+    ASSERT_TRUE(corrupt.find("exception: Error reading file: " + file +
+                             ": corrupt gzip data") != string::npos);
+}
+
+TEST(test_gzip_reads_pipes)
+{
+    string compressed = gzip(read_file("w16_projects_exam.csv"));
+    int fds[2];
+    ASSERT_EQUAL(pipe(fds), 0);
+    thread writer([&]()
+    {
+        for (size_t done = 0; done < compressed.size();)
+        {
+            ssize_t count = write(fds[1], compressed.data() + done,
+                                  compressed.size() - done);
+            if (count <= 0)
+                break;
+            done += count;
+        }
+        close(fds[1]);
+    });
+    string piped = read_all("/dev/fd/" + to_string(fds[0]), csvstream::MMAP);
+    signal(SIGPIPE, SIG_IGN);
+    close(fds[0]);
+    writer.join();
+    ASSERT_EQUAL(piped, read_all("w16_projects_exam.csv", csvstream::STREAM));
+}
+#endif
+
+#ifdef CSVSTREAM_HAVE_ZSTD
+TEST(test_zstd_matches_stream)
+{
+    // Two frames, read as one file like zstd -d does
+    string text = read_file("w16_projects_exam.csv");
+    string compressed;
+    for (const string &part : {text.substr(0, 1000), text.substr(1000)})
+    {
+        string frame(ZSTD_compressBound(part.size()), '\0');
+        frame.resize(ZSTD_compress(&frame[0], frame.size(), part.data(),
+                                   part.size(), 3));
+        compressed += frame;
+    }
+    const string file = "csvstream_tests.out.csv";
+    write_file(file, compressed);
+    string expected = read_all("w16_projects_exam.csv", csvstream::STREAM);
+    ASSERT_EQUAL(read_all(file, csvstream::MMAP), expected);
+    ASSERT_EQUAL(read_all(file, csvstream::BUFFERED), expected);
+    const size_t prefetch_bytes = csvstream::prefetch_bytes;
+    csvstream::prefetch_bytes = 7;
+    ASSERT_EQUAL(read_all(file, csvstream::PREFETCH), expected);
+    csvstream::prefetch_bytes = prefetch_bytes;
+
+    write_file(file, compressed.substr(0, compressed.size() - 5));
+    ASSERT_TRUE(read_all(file, csvstream::PREFETCH).find(
+                    ": truncated zstd data") != string::npos);
+}
+#endif
+
+TEST(test_empty_file)
+{
+    write_file("csvstream_tests.out.csv", "");
+    ASSERT_EQUAL(read_all("csvstream_tests.out.csv", csvstream::MMAP),
+                 "exception: error reading header");
+}
+
+TEST(test_missing_file)
+{
+    ASSERT_EQUAL(read_all("no_such_file.csv", csvstream::MMAP),
+                 "exception: Error opening file: no_such_file.csv");
+}
+
+TEST_MAIN()
@@ -1,385 +1,569 @@
 // Project UID db1f506d06d84ab787baf250c265e24e
 // uniqnames: mileslow and oboyleai
 #include <iostream>
-#include <fstream>
 #include <sstream>
-#include <cassert>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
-#include <set>
-#include <regex>
-#include <exception>
-#include "csvstream.h"
-#include <cmath>
+#include "classifier.h"
 #include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 using namespace std;
 
-class Indentifier
+// Heap allocations made through any form of operator new, counted only
+//  for --stats. The flag is set while parsing arguments, before any
+//  thread starts, so reading it needs no synchronization, and runs
+//  without --stats never touch the shared counter.
+static bool count_allocations = false;
+static atomic<size_t> allocation_count(0);
+
+// Returns size bytes from malloc, aligned to alignment, or null
+static void *allocate(size_t size, size_t alignment = alignof(max_align_t))
+{
+    if (count_allocations)
+        allocation_count.fetch_add(1, memory_order_relaxed);
+    size = size ? size : 1;
+    if (alignment <= alignof(max_align_t))
+        return malloc(size);
+    void *ptr = nullptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+
+// Like allocate, but throws bad_alloc instead of returning null
+static void *allocate_or_throw(size_t size,
+                               size_t alignment = alignof(max_align_t))
 {
-private:
-    bool debug;
+    if (void *ptr = allocate(size, alignment))
+        return ptr;
+    throw bad_alloc();
+}
 
-    // The total number of posts in the entire training set.
-    int post_count = 0;
+void *operator new(size_t size)
+{
+    return allocate_or_throw(size);
+}
 
-    // The number of unique words in the entire training set.
-    //  (The vocabulary size.)
-    int unique_word_count = 0;
+void *operator new[](size_t size)
+{
+    return allocate_or_throw(size);
+}
 
-    // For each word w, the number of posts in the entire
-    //  training set that contain w
-    map<string, int> post_count_per_word;
+void *operator new(size_t size, align_val_t alignment)
+{
+    return allocate_or_throw(size, size_t(alignment));
+}
 
-    // For each label C, the number of posts with that label.
-    map<string, int> post_count_per_label;
+void *operator new[](size_t size, align_val_t alignment)
+{
+    return allocate_or_throw(size, size_t(alignment));
+}
 
-    // For each label C and word  w, the number of posts
-    //  with label C that contain w
-    map<pair<string, string>, int> label_word_freq_map;
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    return allocate(size);
+}
 
-    vector<string> tag_list;
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return allocate(size);
+}
 
-    vector<string> unique_words(const string &str)
-    {
-        istringstream source(str);
-        set<string> words;
-        string word;
-        while (source >> word)
-        {
-            words.insert(word);
-        }
-        return vector<string>(words.begin(), words.end());
-    }
+void *operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    return allocate(size, size_t(alignment));
+}
 
-    bool key_exists_in_map(const map<string, int> &count_map, string key)
-    {
-        return count_map.find(key) != count_map.end();
-    }
+void *operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    return allocate(size, size_t(alignment));
+}
 
-    void print_debug()
-    {
-        cout << "vocabulary size = " << unique_word_count << endl
-             << endl;
-        cout << "classes:" << endl;
+// Every form of operator delete frees what malloc or posix_memalign gave
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
 
-        vector<string> prev_tags;
-        for (string current_tag : tag_list)
-        {
-            vector<string>::iterator prev_begin = prev_tags.begin();
-            vector<string>::iterator prev_end = prev_tags.end();
-            vector<string>::iterator find_it = find(
-                prev_begin, prev_end, current_tag);
-            bool prev_tag_no_exist = find_it == prev_end;
-            if (prev_tag_no_exist)
-            {
-                prev_tags.push_back(current_tag);
-                double post_with_label_c = post_count_per_label[current_tag];
-                double log_prior = log(post_with_label_c / post_count);
-                cout << "  " << current_tag << ", "
-                     << post_with_label_c
-                     << " examples, log-prior = " << log_prior << endl;
-            }
-        }
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
 
-        // classifier parameters
-        cout << "classifier parameters:" << endl;
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
 
-        map<pair<string, string>, int>::iterator it;
-        map<pair<string, string>, int>::iterator begin;
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
 
-        for (it = label_word_freq_map.begin(); it != label_word_freq_map.end(); it++)
-        {
-            double count = it->second;
-            string current_tag = it->first.first;
-            string current_word = it->first.second;
-            double post_count_label_c = post_count_per_label[current_tag];
-            double log_likelihood = log(count / post_count_label_c);
-            cout << "  " << current_tag << ":" << current_word << ", count = "
-                 << count << ", log-likelihood = " << log_likelihood << endl;
-        }
-        cout << endl;
-    }
+void operator delete(void *ptr, align_val_t) noexcept
+{
+    free(ptr);
+}
 
-    void classify_helper(
-        const string &tag,
-        const string &word,
-        double &new_prob,
-        const pair<double, double> &test)
-    {
-        double tag_post_count = test.first;
-        double post_count_double = test.second;
-        pair<string, string> tag_word = {tag, word};
-        // adds the log liklihood probability to the log prior probability
-
-        // if w is seen in the post do this
-        //  new_prob += log(label_word_freq_map[p]
-        // / post_count_per_label[tag]);
-        //  if w does not occur in posts labeled d,
-        // but does occur in training data
-        //   new_prob += log(post_count_per_word[word] / post_count);
-        //  if w doesn't occur anywhere
-        // new_prob += log(1 / post_count);
-        if (label_word_freq_map[tag_word] >= 1)
-        {
-            float tag_word_count = label_word_freq_map[tag_word];
-            // double tag_word_count = ;
-            new_prob += log(tag_word_count / tag_post_count);
-        }
-        else if (post_count_per_word[word] >= 1)
-        {
-            double word_post_count = post_count_per_word[word];
-            // double post_count_double = )
-            new_prob += log(word_post_count / post_count_double);
-        }
-        else
-        {
-            new_prob += log(1.0 / post_count_double);
-        }
-    }
+void operator delete[](void *ptr, align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t, align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, const nothrow_t &) noexcept
+{
+    free(ptr);
+}
 
-public:
-    Indentifier(bool debug_true)
+void operator delete[](void *ptr, const nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, align_val_t, const nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, align_val_t, const nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+// Prints the phase timings and table sizes, the peak resident set size
+//  and the heap allocation count on stderr, leaving stdout alone
+static void print_stats(const Indentifier &ident, RunStats &stats)
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    ident.record_table_sizes();
+    stats.set_counter("peak_rss_kb", usage.ru_maxrss);
+    stats.set_counter("heap_allocations", allocation_count.load());
+    stats.print(cerr);
+}
+
+// Writes all of data to fd, retrying short writes. Returns false on error.
+static bool write_all(int fd, const string &data)
+{
+    size_t done = 0;
+    while (done < data.size())
     {
-        debug = debug_true;
+        ssize_t wrote = write(fd, data.data() + done, data.size() - done);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote < 0)
+            return false;
+        done += wrote;
     }
+    return true;
+}
 
-    void classify(string filename)
+// Sends stdin to the server listening on the Unix domain socket at path
+//  and copies its answers to stdout. Waits up to five seconds for the
+//  server to start listening. Returns false on failure.
+static bool connect_to_server(const string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return false;
+    strcpy(address.sun_path, path.c_str());
+
+    int server = -1;
+    for (int attempt = 0; attempt < 500 && server < 0; attempt++)
     {
-        vector<string> calculated_labels;
-        vector<string> correct_labels;
-        vector<string> label_unique_list;
-        vector<vector<string>> classify_list;
-        vector<double> calculated_log;
-        vector<string> post_contents;
-        int new_post_count = 0;
-        // converts file into string stream
-        csvstream csvin(filename);
-
-        map<string, string> row;
-
-        while (csvin >> row)
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server >= 0 &&
+            connect(server, (sockaddr *)&address, sizeof(address)) != 0)
         {
-            string tag = row["tag"];
-            string content = row["content"];
-            correct_labels.push_back(tag);
-
-            if (find(
-                    label_unique_list.begin(),
-                    label_unique_list.end(), tag) ==
-                label_unique_list.end())
-            {
-                label_unique_list.push_back(tag);
-            }
-
-            // put everything in right here
-            post_contents.push_back(content);
-            classify_list.push_back(unique_words(content));
-            new_post_count++;
+            close(server);
+            server = -1;
+            usleep(10000);
         }
+    }
+    if (server < 0)
+        return false;
 
-        double highest_prob = 0;
-
-        // for every post in the new file
-        for (int i = 0; i < classify_list.size(); i++)
+    // send everything first; the server answers in order as it reads
+    thread sender([server]()
+    {
+        char buffer[1 << 16];
+        ssize_t got;
+        while ((got = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0)
         {
-            highest_prob = 0;
-            string highest_prob_tag;
-            // for every unique post label
-            for (string tag : label_unique_list)
-            {
-                double post_count_double = (double)post_count;
-
-                // calculates log prior probability
-                double tag_post_count = post_count_per_label[tag];
-                double new_prob = log(tag_post_count / post_count_double); // good
-                // for every unique word in each post
-                for (string word : classify_list[i])
-                {
-                    const pair<double, double> test = {tag_post_count, post_count_double};
-                    classify_helper(tag, word, new_prob, test);
-                }
-
-                if (abs(new_prob) < abs(highest_prob) || highest_prob == 0)
-                {
-                    highest_prob_tag = tag;
-                    highest_prob = new_prob;
-                }
-            }
-            calculated_labels.push_back(highest_prob_tag);
-            calculated_log.push_back(highest_prob);
+            if (!write_all(server, string(buffer, got)))
+                break;
         }
+        shutdown(server, SHUT_WR);
+    });
 
-        int num_guessed_properly = 0;
-
-        cout
-            << "test data:" << endl;
-        for (int i = 0; i < new_post_count; i++)
+    bool ok = true;
+    char buffer[1 << 16];
+    ssize_t got;
+    while ((got = read(server, buffer, sizeof(buffer))) != 0)
+    {
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 || !write_all(STDOUT_FILENO, string(buffer, got)))
         {
-            string correct_label = correct_labels[i];
-            string calculated_label = calculated_labels[i];
-            cout << "  "
-                 << "correct = " << correct_label << ", predicted = ";
-            cout << calculated_label << ", log-probability score = "
-                 << calculated_log[i] << endl;
-            cout << "  "
-                 << "content = " << post_contents[i] << endl
-                 << endl;
-            num_guessed_properly += calculated_label == correct_label;
+            ok = false;
+            break;
         }
-        cout << "performance: " << num_guessed_properly
-             << " / " << new_post_count
-             << " posts predicted correctly" << endl;
-        //  << endl;
     }
-
-    void train_on_file(string filename)
+    sender.join();
+    close(server);
+    return ok;
+}
+
+// Appends the answer for one scored post to output: its label and
+//  score, then its top labels if any were asked for
+static void append_answer(const Indentifier &ident, const Prediction &result,
+                          string &output)
+{
+    char score[32];
+    output += ident.label_name(result.label);
+    snprintf(score, sizeof(score), " %.3g", result.log_probability);
+    output += score;
+    for (size_t j = 0; j < result.top_labels.size(); j++)
     {
-        // converts file into string stream
-        csvstream csvin(filename);
-        map<string, string> row;
-
-        if (debug)
-            cout << "training data:\n";
-        vector<string> words_done;
+        output += j ? ", " : " | ";
+        output += ident.label_name(result.top_labels[j].first);
+        snprintf(score, sizeof(score), " %.3g", result.top_labels[j].second);
+        output += score;
+    }
+    output += '\n';
+}
+
+// Splits off the complete lines at the front of input, and the last line
+//  too at the end of the input, into lines, and the ones with any words
+//  into posts. Returns how many bytes of input they took up.
+static size_t split_lines(string_view input, bool at_end,
+                          vector<string_view> &lines, vector<string_view> &posts)
+{
+    lines.clear();
+    posts.clear();
+    size_t line_begin = 0;
+    while (line_begin < input.size())
+    {
+        size_t line_end = input.find('\n', line_begin);
+        if (line_end == string_view::npos && !at_end)
+            break;
+        line_end = min(line_end, input.size());
+        string_view line = input.substr(line_begin, line_end - line_begin);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        lines.push_back(line);
+        if (line.find_first_not_of(" \t\n\v\f\r") != string_view::npos)
+            posts.push_back(line);
+        line_begin = line_end + 1;
+    }
+    return min(line_begin, input.size());
+}
+
+// Answers posts read from in_fd, one per line, with a "label score"
+//  line each on out_fd until the input ends. A blank line has no words
+//  to score, so it gets an empty line back. Every complete line read so
+//  far is scored as one batch and answered with one write, so a client
+//  sending many posts at once pays for few system calls. Scoring holds
+//  scoring_lock, so clients on other threads can share ident.
+//  Returns false if reading or writing fails.
+static bool serve_posts(Indentifier &ident, int in_fd, int out_fd,
+                        mutex &scoring_lock)
+{
+    string input(1 << 16, '\0');
+    size_t input_size = 0;
+    vector<string_view> lines;
+    vector<string_view> posts;
+    vector<Prediction> results;
+    string output;
+    bool at_end = false;
+    while (!at_end)
+    {
+        if (input_size == input.size())
+            input.resize(input.size() * 2);
+        ssize_t got = read(in_fd, &input[input_size], input.size() - input_size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return false;
+        at_end = got == 0;
+        input_size += got;
 
-        while (csvin >> row)
+        size_t consumed = split_lines(string_view(input.data(), input_size),
+                                      at_end, lines, posts);
+        output.clear();
         {
-
-            string tag = row["tag"];
-            string content = row["content"];
-
-            // debug stuff
-            if (debug)
+            lock_guard<mutex> lock(scoring_lock);
+            ident.classify_batch(posts, results);
+            size_t post = 0;
+            for (string_view line : lines)
             {
-                cout << "  label = " << tag << ", content = " << content << endl;
+                if (post < posts.size() && line.data() == posts[post].data())
+                    append_answer(ident, results[post++], output);
+                else
+                    output += '\n';
             }
-
-            // adds to post_count_per_word map
-            if (!key_exists_in_map(post_count_per_label, tag))
-                post_count_per_label[tag] = 1;
-            else
-                post_count_per_label[tag]++;
-
-            vector<string> content_words = unique_words(content);
-            vector<string> total_unique_words;
-
-            for (string word : content_words)
-            {
-
-                // adds word to total unique words if it
-                // doesn't already exist in list
-                bool word_is_unique = true;
-                for (string unique_word : total_unique_words)
-                {
-                    if (unique_word == word)
-                    {
-                        word_is_unique = false;
-                    }
-                }
-                if (word_is_unique)
-                {
-                    if (find(words_done.begin(),
-                             words_done.end(), word) == words_done.end())
-                    {
-                        words_done.push_back(word);
-                        unique_word_count += word_is_unique;
-                    }
-                    total_unique_words.push_back(word);
-
-                    // increments spot in map for word
-                    if (!key_exists_in_map(post_count_per_word, word))
-                        post_count_per_word[word] = 1;
-                    else
-                        post_count_per_word[word]++;
-
-                    // increments spot in map for pair
-                    pair<string, string> label_word = {tag, word};
-                    if (label_word_freq_map.find(label_word) ==
-                        label_word_freq_map.end())
-                    {
-                        label_word_freq_map[label_word] = 1;
-                    }
-                    else
-                    {
-                        label_word_freq_map[label_word]++;
-                    }
-                }
-            }
-
-            // if not already contained in tag_list
-            // if (find(tag_list.begin(), tag_list.end(), tag) == tag_list.end())
-            tag_list.push_back(tag);
-
-            post_count++;
         }
-        sort(tag_list.begin(), tag_list.end());
-        cout << "trained on " << post_count << " examples\n";
+        memmove(&input[0], &input[consumed], input_size - consumed);
+        input_size -= consumed;
+        if (!write_all(out_fd, output))
+            return false;
+    }
+    return true;
+}
+
+// Listens on a Unix domain socket at path and serves every client on
+//  its own thread until it closes its end, so a slow client only holds
+//  up itself. Clients take turns scoring. Only returns if the socket
+//  cannot be set up.
+static bool serve_socket(Indentifier &ident, const string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (path.size() >= sizeof(address.sun_path) || listener < 0)
+    {
+        cerr << "Error opening socket: " << path << endl;
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, 16) != 0)
+    {
+        cerr << "Error opening socket: " << path << endl;
+        close(listener);
+        return false;
+    }
 
-        if (!debug)
-        {
-            cout << endl;
-        }
-        else
+    // a client that hangs up early must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    mutex scoring_lock;
+    while (true)
+    {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        thread([&ident, &scoring_lock, client]()
         {
-            print_debug();
-        }
+            serve_posts(ident, client, client, scoring_lock);
+            close(client);
+        }).detach();
     }
+}
+
+static const char *USAGE =
+    "Usage: main.exe TRAIN_FILE TEST_FILE [--debug] [--threads N] [--stream] "
+    "[--labels L1,L2,...] [--kernel K] [--top-k K] [--update FILE] "
+    "[--save-model FILE] [--stats] [--cache]\n"
+    "       main.exe --load-model FILE TEST_FILE [--debug] [--threads N] "
+    "[--stream] [--labels L1,L2,...] [--kernel K] [--top-k K] "
+    "[--update FILE] [--save-model FILE] [--stats]\n"
+    "       main.exe TRAIN_FILE --serve [--socket PATH] [OPTIONS]\n"
+    "       main.exe --load-model FILE --serve [--socket PATH] [OPTIONS]\n"
+    "       main.exe --connect PATH";
+
+// What the command line asks for
+struct Options
+{
+    bool debug = false;
+    int threads = 1;
+    bool stream = false;
+    bool cache = false;
+    string save_model;
+    string load_model;
+    vector<string> updates;
+    bool serve = false;
+    bool show_stats = false;
+    string socket_path;
+    vector<string> allowed_labels;
+    string kernel = "auto";
+    int top_k = 0;
+    vector<string> files;
+};
 
-    bool test_files_work(string file1, string file2)
+// Sets the option that arg names, if it is a flag without a value.
+//  Returns false if it is not one.
+static bool parse_flag(const char *arg, Options &options)
+{
+    if (strcmp(arg, "--debug") == 0)
+        options.debug = true;
+    else if (strcmp(arg, "--stream") == 0)
+        options.stream = true;
+    else if (strcmp(arg, "--cache") == 0)
+        options.cache = true;
+    else if (strcmp(arg, "--serve") == 0)
+        options.serve = true;
+    else if (strcmp(arg, "--stats") == 0)
+        options.show_stats = true;
+    else
+        return false;
+    return true;
+}
+
+// Sets the option that arg names to value, if it is an option that takes
+//  one. Returns false if it is not one, or value is not valid for it.
+static bool parse_value(const char *arg, const char *value, Options &options)
+{
+    if (strcmp(arg, "--threads") == 0 && atoi(value) > 0)
+        options.threads = atoi(value);
+    else if (strcmp(arg, "--top-k") == 0 && atoi(value) > 0)
+        options.top_k = atoi(value);
+    else if (strcmp(arg, "--kernel") == 0)
+        options.kernel = value;
+    else if (strcmp(arg, "--save-model") == 0)
+        options.save_model = value;
+    else if (strcmp(arg, "--load-model") == 0)
+        options.load_model = value;
+    else if (strcmp(arg, "--update") == 0)
+        options.updates.push_back(value);
+    else if (strcmp(arg, "--socket") == 0)
+        options.socket_path = value;
+    else if (strcmp(arg, "--labels") == 0)
+    {
+        istringstream names(value);
+        string name;
+        while (getline(names, name, ','))
+            options.allowed_labels.push_back(name);
+    }
+    else
+        return false;
+    return true;
+}
+
+// Reads the command line into options. Returns false if it does not
+//  match the usage.
+static bool parse_args(int argc, char *argv[], Options &options)
+{
+    bool args_ok = true;
+    for (int i = 1; i < argc && args_ok; i++)
     {
-        try
+        if (parse_flag(argv[i], options))
+            continue;
+        if (i + 1 < argc && parse_value(argv[i], argv[i + 1], options))
         {
-            csvstream ming(file1);
+            i++;
+            continue;
         }
-        catch (const csvstream_exception &e)
-        {
-            cout << "Error opening file: " << file1 << endl;
+        args_ok = strncmp(argv[i], "--", 2) != 0;
+        options.files.push_back(argv[i]);
+    }
+    // the posts to classify come from the test file, or from clients
+    size_t num_files = (options.load_model.empty() ? 1 : 0) + (options.serve ? 0 : 1);
+    return args_ok && options.files.size() == num_files &&
+           (options.socket_path.empty() || options.serve);
+}
+
+// Trains on or loads the model options name and adds their updates, then
+//  prints the training summary and saves the model if asked to. Returns
+//  false on failure.
+static bool prepare_model(Indentifier &ident, const Options &options)
+{
+    for (const string &update : options.updates)
+    {
+        if (!ident.test_file_works(update))
             return false;
-        }
-        try
-        {
-            csvstream ming(file2);
-        }
-        catch (const csvstream_exception &e)
-        {
-            cout << "Error opening file: " << file2 << endl;
+    }
+    for (const string &file : options.files)
+    {
+        if (!ident.test_file_works(file))
             return false;
-        }
-        return true;
     }
-};
+    if (!options.load_model.empty())
+    {
+        if (!ident.load_model(options.load_model))
+            return false;
+    }
+    else
+    {
+        ident.train_on_file(options.files[0]);
+    }
+    for (const string &update : options.updates)
+        ident.add_file(update);
+    // stdout only carries answers when serving stdin, so only the debug
+    //  summary is printed then, to stderr
+    if (!options.serve || !options.socket_path.empty() || options.debug)
+        ident.print_training_summary();
+    if (!options.save_model.empty() && !ident.save_model(options.save_model))
+        return false;
+    return options.allowed_labels.empty() ||
+           ident.set_allowed_labels(options.allowed_labels);
+}
 
 int main(int argc, char *argv[])
 {
     cout.precision(3);
-    bool debug = false;
-    // error checking
-    if (argc != 3 && argc != 4)
-    {
-        cout << "Usage: main.exe TRAIN_FILE TEST_FILE [--debug]" << endl;
-        return 1;
-    }
-    if (argc == 4)
+    if (argc == 3 && strcmp(argv[1], "--connect") == 0)
     {
-        if (strcmp(argv[3], "--debug") != 0)
+        if (!connect_to_server(argv[2]))
         {
-            cout << "Usage: main.exe TRAIN_FILE TEST_FILE [--debug]" << endl;
+            cerr << "Error connecting to socket: " << argv[2] << endl;
             return 1;
         }
-        else
-        {
-            debug = true;
-        }
+        return 0;
     }
 
-    string file1 = argv[1];
-    string file2 = argv[2];
-
-    Indentifier ident(debug);
-    if (!ident.test_files_work(file1, file2))
+    // error checking
+    Options options;
+    if (!parse_args(argc, argv, options))
+    {
+        cout << USAGE << endl;
+        return 1;
+    }
+    count_allocations = options.show_stats;
+
+    // when serving stdin, stdout only carries answers, so the training
+    //  summary, debug output and errors go to stderr
+    bool serve_stdin = options.serve && options.socket_path.empty();
+    Indentifier ident(options.debug, options.threads, serve_stdin ? cerr : cout);
+    RunStats stats;
+    if (options.show_stats)
+        ident.set_stats(&stats);
+    ident.set_top_k(options.top_k);
+    ident.set_training_cache(options.cache);
+    if (!ident.set_kernel(options.kernel))
+    {
+        cout << USAGE << endl;
         return 1;
-    ident.train_on_file(file1);
-    ident.classify(file2);
-}
\ No newline at end of file
+    }
+    if (!prepare_model(ident, options))
+        return 1;
+    // serving never finishes a phase, so report what led up to it
+    if (options.show_stats && options.serve)
+        print_stats(ident, stats);
+    if (options.serve && !options.socket_path.empty())
+        return serve_socket(ident, options.socket_path) ? 0 : 1;
+    if (options.serve)
+    {
+        mutex scoring_lock;
+        return serve_posts(ident, STDIN_FILENO, STDOUT_FILENO, scoring_lock) ? 0 : 1;
+    }
+    if (options.stream)
+        ident.classify_stream(options.files.back());
+    else
+        ident.classify(options.files.back());
+    if (options.show_stats)
+        print_stats(ident, stats);
+}